@@ -0,0 +1,409 @@
+/*
+ * Licensed Materials - Property of IBM
+ * (C) Copyright IBM Corp. 2017. All Rights Reserved.
+ * US Government Users Restricted Rights - Use, duplication or disclosure restricted by GSA ADP Schedule Contract with IBM Corp.
+*/
+#include "VsamChangeLog.h"
+#include <string.h>
+#include <sys/time.h>
+#include <stdint.h>
+#include <algorithm>
+#include <new>
+#include <sstream>
+
+uv_mutex_t VsamChangeLog::mutex_;
+std::atomic<unsigned> VsamChangeLog::generation_(0);
+std::map<std::string, std::shared_ptr<VsamChangeLog> > VsamChangeLog::logs_;
+const size_t VsamChangeLog::kMaxCapacity;
+Napi::FunctionReference VsamChangeFeed::constructor_;
+
+static double now_ms() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000;
+}
+
+
+VsamChangeLog::VsamChangeLog(unsigned reclen, size_t capacity)
+: reclen_(reclen),
+    mask_(capacity - 1),
+    slots_(capacity),
+    images_(capacity * 2 * reclen),
+    head_(0),
+    subscribed_(0),
+    closed_(false) {
+  uv_mutex_init(&submutex_);
+}
+
+
+void VsamChangeLog::Init(Napi::Env env, Napi::Object exports) {
+  static bool initialized = false;
+  if (!initialized) {
+    uv_mutex_init(&mutex_);
+    initialized = true;
+  }
+  VsamChangeFeed::Init(env, exports);
+}
+
+
+std::shared_ptr<VsamChangeLog> VsamChangeLog::Enable(const std::string& path, unsigned reclen,
+                                                     size_t capacity, std::string& errmsg) {
+  // A capacity of 0 takes the log already enabled, or the default for a new one
+  size_t slots = 1;
+  while (slots < (capacity ? capacity : 4096))
+    slots <<= 1;
+
+  if (slots > kMaxCapacity || reclen > SIZE_MAX / 2 / slots) {
+    std::ostringstream msg;
+    msg << "Change log capacity must be at most " << kMaxCapacity << ".";
+    errmsg = msg.str();
+    return NULL;
+  }
+
+  uv_mutex_lock(&mutex_);
+  std::shared_ptr<VsamChangeLog>& log = logs_[path];
+  if (!log) {
+    try {
+      log = std::make_shared<VsamChangeLog>(reclen, slots);
+    } catch (const std::bad_alloc&) {
+      logs_.erase(path);
+      uv_mutex_unlock(&mutex_);
+      errmsg = "Not enough memory for the change log.";
+      return NULL;
+    }
+    // Tell handles already open on the dataset to look it up
+    generation_.fetch_add(1, std::memory_order_release);
+  }
+  std::shared_ptr<VsamChangeLog> result = log;
+  uv_mutex_unlock(&mutex_);
+
+  if (capacity && result->Capacity() != slots) {
+    std::ostringstream msg;
+    msg << "Change capture is already enabled with a capacity of " << result->Capacity() << ".";
+    errmsg = msg.str();
+    result.reset();
+  }
+  return result;
+}
+
+
+bool VsamChangeLog::Disable(const std::string& path) {
+  std::shared_ptr<VsamChangeLog> log;
+  uv_mutex_lock(&mutex_);
+  auto i = logs_.find(path);
+  if (i != logs_.end()) {
+    log = i->second;
+    logs_.erase(i);
+    generation_.fetch_add(1, std::memory_order_release);
+  }
+  uv_mutex_unlock(&mutex_);
+  if (log)
+    log->Close();
+  return log != NULL;
+}
+
+
+std::shared_ptr<VsamChangeLog> VsamChangeLog::Find(const std::string& path) {
+  std::shared_ptr<VsamChangeLog> result;
+  uv_mutex_lock(&mutex_);
+  auto i = logs_.find(path);
+  if (i != logs_.end())
+    result = i->second;
+  uv_mutex_unlock(&mutex_);
+  return result;
+}
+
+
+void VsamChangeLog::Append(const char* before, const char* after) {
+  uint64_t seq = head_.fetch_add(1, std::memory_order_acq_rel) + 1;
+  Slot& slot = slots_[seq & mask_];
+  char* image = &images_[(seq & mask_) * 2 * reclen_];
+
+  // Only a writer a whole ring apart can want the same slot
+  while (slot.busy.exchange(true, std::memory_order_acquire))
+    ;
+  if (slot.seq.load(std::memory_order_relaxed) < seq) {
+    slot.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.timestamp = now_ms();
+    slot.before = before != NULL;
+    slot.after = after != NULL;
+    if (before)
+      memcpy(image, before, reclen_);
+    if (after)
+      memcpy(image + reclen_, after, reclen_);
+    slot.seq.store(seq, std::memory_order_release);
+  }
+  slot.busy.store(false, std::memory_order_release);
+
+  if (subscribed_.load(std::memory_order_acquire) > 0) {
+    uv_mutex_lock(&submutex_);
+    for (auto i = subscribers_.begin(); i != subscribers_.end(); ++i)
+      uv_async_send(*i);
+    uv_mutex_unlock(&submutex_);
+  }
+}
+
+
+VsamChangeLog::Status VsamChangeLog::Read(uint64_t seq, Change& change) const {
+  if (seq < Oldest())
+    return LOST;
+  const Slot& slot = slots_[seq & mask_];
+  const char* image = &images_[(seq & mask_) * 2 * reclen_];
+  uint64_t published = slot.seq.load(std::memory_order_acquire);
+  if (published != seq)
+    return published > seq ? LOST : PENDING;
+
+  change.seq = seq;
+  change.timestamp = slot.timestamp;
+  if (slot.before)
+    change.before.assign(image, image + reclen_);
+  else
+    change.before.clear();
+  if (slot.after)
+    change.after.assign(image + reclen_, image + 2 * reclen_);
+  else
+    change.after.clear();
+
+  // A writer that lapped us while copying has changed the number
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return slot.seq.load(std::memory_order_relaxed) == seq ? OK : LOST;
+}
+
+
+void VsamChangeLog::Close() {
+  // Wake the feeds so that they end once they have read what is left
+  closed_.store(true, std::memory_order_release);
+  uv_mutex_lock(&submutex_);
+  for (auto i = subscribers_.begin(); i != subscribers_.end(); ++i)
+    uv_async_send(*i);
+  uv_mutex_unlock(&submutex_);
+}
+
+
+uint64_t VsamChangeLog::Oldest() const {
+  uint64_t head = Head();
+  return head > mask_ ? head - mask_ : 1;
+}
+
+
+void VsamChangeLog::Subscribe(uv_async_t* async) {
+  uv_mutex_lock(&submutex_);
+  subscribers_.push_back(async);
+  subscribed_.store((int)subscribers_.size(), std::memory_order_release);
+  uv_mutex_unlock(&submutex_);
+}
+
+
+void VsamChangeLog::Unsubscribe(uv_async_t* async) {
+  uv_mutex_lock(&submutex_);
+  subscribers_.erase(std::remove(subscribers_.begin(), subscribers_.end(), async),
+                     subscribers_.end());
+  subscribed_.store((int)subscribers_.size(), std::memory_order_release);
+  uv_mutex_unlock(&submutex_);
+}
+
+
+VsamChangeFeed::VsamChangeFeed(const Napi::CallbackInfo& info)
+: Napi::ObjectWrap<VsamChangeFeed>(info),
+    env_(info.Env()),
+    key_i_(0),
+    keyoff_(0),
+    next_(1),
+    stopped_(true),
+    async_(NULL) {
+  Napi::HandleScope scope(env_);
+
+  if (info.Length() != 2 || !info[0].IsObject() || !info[1].IsNumber()) {
+    Napi::Error::New(env_, "Wrong number of arguments to VsamChangeFeed::VsamChangeFeed")
+        .ThrowAsJavaScriptException();
+    return;
+  }
+  if (!info[0].As<Napi::Object>().InstanceOf(VsamFile::constructor_.Value())) {
+    Napi::TypeError::New(env_, "VsamChangeFeed must be created with changes() on a VSAM file.")
+        .ThrowAsJavaScriptException();
+    return;
+  }
+
+  VsamFile* file = Napi::ObjectWrap<VsamFile>::Unwrap(info[0].As<Napi::Object>());
+  log_ = VsamChangeLog::Find(file->path_);
+  if (!log_) {
+    Napi::Error::New(env_, "Change capture is not enabled for this dataset.")
+        .ThrowAsJavaScriptException();
+    return;
+  }
+  layout_ = file->layout_;
+  key_i_ = file->key_i_;
+  keyoff_ = file->keyoff_;
+  int64_t from = info[1].As<Napi::Number>().Int64Value();
+  next_ = from > 0 ? (uint64_t)from : log_->Head() + 1;
+
+  // Only holds the loop open while a next() is waiting
+  context_.reset(new Napi::AsyncContext(env_, "VsamChangeFeed"));
+  async_ = new uv_async_t;
+  uv_async_init(uv_default_loop(), async_, VsamChangeFeed::Notified);
+  async_->data = this;
+  uv_unref((uv_handle_t*)async_);
+  log_->Subscribe(async_);
+  stopped_ = false;
+}
+
+
+VsamChangeFeed::~VsamChangeFeed() {
+  Stop();
+}
+
+
+void VsamChangeFeed::Init(Napi::Env env, Napi::Object exports) {
+  Napi::HandleScope scope(env);
+
+  Napi::Function func = DefineClass(env, "VsamChangeFeed", {
+    InstanceMethod("next", &VsamChangeFeed::Next),
+    InstanceMethod("return", &VsamChangeFeed::Return)
+  });
+
+  // for await (const change of feed) { ... }
+  Napi::Value symbol = env.Global().Get("Symbol").As<Napi::Object>().Get("asyncIterator");
+  func.Get("prototype").As<Napi::Object>().Set(symbol,
+      Napi::Function::New(env, VsamChangeFeed::Iterator));
+
+  constructor_ = Napi::Persistent(func);
+  constructor_.SuppressDestruct();
+
+  exports.Set("VsamChangeFeed", func);
+}
+
+
+Napi::Object VsamChangeFeed::New(Napi::Env env, Napi::Object file, uint64_t from) {
+  return constructor_.New({file, Napi::Number::New(env, (double)from)});
+}
+
+
+Napi::Value VsamChangeFeed::Iterator(const Napi::CallbackInfo& info) {
+  return info.This();
+}
+
+
+Napi::Object VsamChangeFeed::Result(Napi::Value value, bool done) {
+  Napi::Object result = Napi::Object::New(env_);
+  result.Set("value", value);
+  result.Set("done", Napi::Boolean::New(env_, done));
+  return result;
+}
+
+
+Napi::Value VsamChangeFeed::Next(const Napi::CallbackInfo& info) {
+  Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env_);
+  if (pending_) {
+    deferred.Reject(Napi::Error::New(env_, "A previous next() is still pending.").Value());
+    return deferred.Promise();
+  }
+  pending_.reset(new Napi::Promise::Deferred(deferred));
+  if (!Settle()) {
+    // Wait for a writer to publish; keep the feed and the loop alive till then
+    Ref();
+    uv_ref((uv_handle_t*)async_);
+  }
+  return deferred.Promise();
+}
+
+
+Napi::Value VsamChangeFeed::Return(const Napi::CallbackInfo& info) {
+  Stop();
+  if (pending_) {
+    Settle();
+    Unref();
+  }
+  Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env_);
+  deferred.Resolve(Result(env_.Undefined(), true));
+  return deferred.Promise();
+}
+
+
+bool VsamChangeFeed::Settle() {
+  Napi::HandleScope scope(env_);
+  Napi::Promise::Deferred deferred = *pending_;
+
+  if (stopped_) {
+    deferred.Resolve(Result(env_.Undefined(), true));
+    pending_.reset();
+    return true;
+  }
+
+  VsamChangeLog::Change change;
+  VsamChangeLog::Status status = log_->Read(next_, change);
+  if (status == VsamChangeLog::PENDING) {
+    if (!log_->Closed())
+      return false;
+    // Capture was stopped and every change recorded has been read
+    Stop();
+    deferred.Resolve(Result(env_.Undefined(), true));
+    pending_.reset();
+    return true;
+  }
+
+  if (status == VsamChangeLog::LOST) {
+    // Skip to the oldest change still held; the caller has to resync
+    uint64_t oldest = std::max(log_->Oldest(), next_ + 1);
+    std::ostringstream msg;
+    msg << "Change log overflow: " << oldest - next_ << " changes lost.";
+    Napi::Error error = Napi::Error::New(env_, msg.str());
+    error.Value().Set("lost", Napi::Number::New(env_, (double)(oldest - next_)));
+    error.Value().Set("nextSeq", Napi::Number::New(env_, (double)oldest));
+    next_ = oldest;
+    deferred.Reject(error.Value());
+    pending_.reset();
+    return true;
+  }
+
+  const char* image = change.after.empty() ? &change.before[0] : &change.after[0];
+  Napi::Object record = Napi::Object::New(env_);
+  record.Set("seq", Napi::Number::New(env_, (double)change.seq));
+  record.Set("timestamp", Napi::Number::New(env_, change.timestamp));
+  record.Set("op", Napi::String::New(env_, change.before.empty() ? "write"
+                                           : change.after.empty() ? "delete" : "update"));
+  record.Set("key", VsamFile::DecodeField(env_, layout_[key_i_], image + keyoff_));
+  record.Set("before", change.before.empty() ? env_.Null()
+             : (Napi::Value)VsamFile::DecodeRecord(env_, layout_, &change.before[0]));
+  record.Set("after", change.after.empty() ? env_.Null()
+             : (Napi::Value)VsamFile::DecodeRecord(env_, layout_, &change.after[0]));
+  next_++;
+  deferred.Resolve(Result(record, false));
+  pending_.reset();
+  return true;
+}
+
+
+void VsamChangeFeed::Stop() {
+  if (stopped_)
+    return;
+  stopped_ = true;
+  log_->Unsubscribe(async_);
+  uv_close((uv_handle_t*)async_, VsamChangeFeed::Closed);
+  async_ = NULL;
+}
+
+
+void VsamChangeFeed::Notified(uv_async_t* async) {
+  VsamChangeFeed* feed = (VsamChangeFeed*)(async->data);
+  if (feed->pending_)
+    feed->Notify();
+}
+
+
+void VsamChangeFeed::Notify() {
+  // Called from the loop rather than from Javascript: the callback scope runs
+  // the promise reactions once the next() promise is settled
+  Napi::HandleScope scope(env_);
+  Napi::CallbackScope callback(env_, *context_);
+  if (Settle()) {
+    if (async_ != NULL)
+      uv_unref((uv_handle_t*)async_);
+    Unref();
+  }
+}
+
+
+void VsamChangeFeed::Closed(uv_handle_t* handle) {
+  delete (uv_async_t*)handle;
+}
@@ -0,0 +1,117 @@
+/*
+ * Licensed Materials - Property of IBM
+ * (C) Copyright IBM Corp. 2017. All Rights Reserved.
+ * US Government Users Restricted Rights - Use, duplication or disclosure restricted by GSA ADP Schedule Contract with IBM Corp.
+*/
+
+#pragma once
+#include <napi.h>
+#include <uv.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "VsamFile.h"
+
+/* Bounded ring of the changes made to one dataset through any handle in the
+ * process. A writer claims a sequence number with one atomic increment, fills
+ * the slot it maps to and publishes it by storing the number in the slot.
+ * Readers copy a slot and check its number before and after, so a slot that a
+ * writer laps while it is being copied is reported as lost, never torn.
+ * Writers never wait for readers; a reader that falls more than a ring behind
+ * loses the oldest changes and is told how many. */
+class VsamChangeLog {
+ public:
+  enum Status { OK, PENDING, LOST };
+
+  static const size_t kMaxCapacity = 1 << 20;   // changes held by one ring
+
+  struct Change {
+    uint64_t seq;
+    double timestamp;             // ms since the epoch
+    std::vector<char> before;     // empty for a write
+    std::vector<char> after;      // empty for a delete
+  };
+
+  VsamChangeLog(unsigned reclen, size_t capacity);
+
+  static void Init(Napi::Env env, Napi::Object exports);
+  static std::shared_ptr<VsamChangeLog> Enable(const std::string& path, unsigned reclen,
+                                               size_t capacity, std::string& errmsg);
+  static bool Disable(const std::string& path);
+  static std::shared_ptr<VsamChangeLog> Find(const std::string& path);
+  static unsigned Generation() { return generation_.load(std::memory_order_acquire); }
+
+  void Append(const char* before, const char* after);
+  void Close();
+  Status Read(uint64_t seq, Change& change) const;
+  uint64_t Head() const { return head_.load(std::memory_order_acquire); }
+  uint64_t Oldest() const;
+  size_t Capacity() const { return mask_ + 1; }
+  bool Closed() const { return closed_.load(std::memory_order_acquire); }
+  void Subscribe(uv_async_t* async);
+  void Unsubscribe(uv_async_t* async);
+
+ private:
+  struct Slot {
+    std::atomic<uint64_t> seq;    // 0 while being written
+    std::atomic<bool> busy;       // held by the writer filling the slot
+    double timestamp;
+    bool before, after;
+    Slot() : seq(0), busy(false), timestamp(0), before(false), after(false) {}
+  };
+
+  /* Data */
+  static uv_mutex_t mutex_;
+  static std::atomic<unsigned> generation_;
+  static std::map<std::string, std::shared_ptr<VsamChangeLog> > logs_;
+
+  unsigned reclen_;
+  uint64_t mask_;
+  std::vector<Slot> slots_;
+  std::vector<char> images_;      // before and after image of each slot
+  std::atomic<uint64_t> head_;
+  std::atomic<int> subscribed_;
+  std::atomic<bool> closed_;      // capture stopped, feeds end once caught up
+  uv_mutex_t submutex_;
+  std::vector<uv_async_t*> subscribers_;
+};
+
+/* Async iterator over a VsamChangeLog, returned by VsamFile changes(). */
+class VsamChangeFeed : public Napi::ObjectWrap<VsamChangeFeed> {
+ public:
+  static void Init(Napi::Env env, Napi::Object exports);
+  static Napi::Object New(Napi::Env env, Napi::Object file, uint64_t from);
+  VsamChangeFeed(const Napi::CallbackInfo& info);
+  ~VsamChangeFeed();
+
+ private:
+  /* Entry point from Javascript */
+  Napi::Value Next(const Napi::CallbackInfo& info);
+  Napi::Value Return(const Napi::CallbackInfo& info);
+  static Napi::Value Iterator(const Napi::CallbackInfo& info);
+
+  /* Async callbacks */
+  static void Notified(uv_async_t* async);
+  static void Closed(uv_handle_t* handle);
+
+  /* Private methods */
+  void Notify();
+  bool Settle();
+  void Stop();
+  Napi::Object Result(Napi::Value value, bool done);
+
+  /* Data */
+  static Napi::FunctionReference constructor_;
+  Napi::Env env_;
+  std::shared_ptr<VsamChangeLog> log_;
+  std::vector<VsamFile::LayoutItem> layout_;
+  int key_i_;
+  unsigned keyoff_;
+  uint64_t next_;
+  bool stopped_;
+  uv_async_t* async_;
+  std::unique_ptr<Napi::AsyncContext> context_;  // for settling from the loop
+  std::unique_ptr<Napi::Promise::Deferred> pending_;
+};
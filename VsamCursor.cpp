@@ -0,0 +1,103 @@
+/*
+ * Licensed Materials - Property of IBM
+ * (C) Copyright IBM Corp. 2017. All Rights Reserved.
+ * US Government Users Restricted Rights - Use, duplication or disclosure restricted by GSA ADP Schedule Contract with IBM Corp.
+*/
+#include "VsamCursor.h"
+
+Napi::FunctionReference VsamCursor::constructor_;
+
+
+VsamCursor::VsamCursor(const Napi::CallbackInfo& info)
+: Napi::ObjectWrap<VsamCursor>(info),
+    env_(info.Env()),
+    file_(NULL) {
+  Napi::HandleScope scope(env_);
+
+  if (info.Length() != 1 || !info[0].IsObject() ||
+      !info[0].As<Napi::Object>().InstanceOf(VsamFile::constructor_.Value())) {
+    Napi::TypeError::New(env_, "VsamCursor must be created with cursor() on an open VSAM file.")
+        .ThrowAsJavaScriptException();
+    return;
+  }
+
+  // Keep the handle alive for as long as the cursor is reachable.
+  Napi::Object file = info[0].As<Napi::Object>();
+  fileref_ = Napi::Persistent(file);
+  file_ = Napi::ObjectWrap<VsamFile>::Unwrap(file);
+  pos_ = std::make_shared<VsamFile::Position>(file_->keylen_);
+}
+
+
+void VsamCursor::Init(Napi::Env env, Napi::Object exports) {
+  Napi::HandleScope scope(env);
+
+  Napi::Function func = DefineClass(env, "VsamCursor", {
+    InstanceMethod("read", &VsamCursor::Read),
+    InstanceMethod("find", &VsamCursor::FindEq),
+    InstanceMethod("findeq", &VsamCursor::FindEq),
+    InstanceMethod("findge", &VsamCursor::FindGe),
+    InstanceMethod("findfirst", &VsamCursor::FindFirst),
+    InstanceMethod("findlast", &VsamCursor::FindLast),
+    InstanceMethod("update", &VsamCursor::Update),
+    InstanceMethod("write", &VsamCursor::Write),
+    InstanceMethod("delete", &VsamCursor::Delete)
+  });
+
+  constructor_ = Napi::Persistent(func);
+  constructor_.SuppressDestruct();
+
+  exports.Set("VsamCursor", func);
+}
+
+
+Napi::Object VsamCursor::New(Napi::Env env, Napi::Object file) {
+  return constructor_.New({file});
+}
+
+
+void VsamCursor::Dispatch(const Napi::CallbackInfo& info, Method method) {
+  if (file_->stream_ == NULL) {
+    Napi::Error::New(env_, "VSAM file is not open.").ThrowAsJavaScriptException();
+    return;
+  }
+
+  // The op runs through the handle, which picks up active_ when it queues
+  // its work; the handle's own position is active again once we return.
+  file_->active_ = pos_;
+  (file_->*method)(info);
+  file_->active_ = file_->pos_;
+}
+
+
+void VsamCursor::Read(const Napi::CallbackInfo& info) {
+  Dispatch(info, &VsamFile::Read);
+}
+
+void VsamCursor::FindEq(const Napi::CallbackInfo& info) {
+  Dispatch(info, &VsamFile::FindEq);
+}
+
+void VsamCursor::FindGe(const Napi::CallbackInfo& info) {
+  Dispatch(info, &VsamFile::FindGe);
+}
+
+void VsamCursor::FindFirst(const Napi::CallbackInfo& info) {
+  Dispatch(info, &VsamFile::FindFirst);
+}
+
+void VsamCursor::FindLast(const Napi::CallbackInfo& info) {
+  Dispatch(info, &VsamFile::FindLast);
+}
+
+void VsamCursor::Update(const Napi::CallbackInfo& info) {
+  Dispatch(info, &VsamFile::Update);
+}
+
+void VsamCursor::Write(const Napi::CallbackInfo& info) {
+  Dispatch(info, &VsamFile::Write);
+}
+
+void VsamCursor::Delete(const Napi::CallbackInfo& info) {
+  Dispatch(info, &VsamFile::Delete);
+}
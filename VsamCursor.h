@@ -0,0 +1,39 @@
+/*
+ * Licensed Materials - Property of IBM
+ * (C) Copyright IBM Corp. 2017. All Rights Reserved.
+ * US Government Users Restricted Rights - Use, duplication or disclosure restricted by GSA ADP Schedule Contract with IBM Corp.
+*/
+
+#pragma once
+#include <napi.h>
+#include "VsamFile.h"
+
+class VsamCursor : public Napi::ObjectWrap<VsamCursor> {
+ public:
+  static void Init(Napi::Env env, Napi::Object exports);
+  static Napi::Object New(Napi::Env env, Napi::Object file);
+  VsamCursor(const Napi::CallbackInfo& info);
+
+ private:
+  typedef void (VsamFile::*Method)(const Napi::CallbackInfo& info);
+
+  /* Entry point from Javascript */
+  void Read(const Napi::CallbackInfo& info);
+  void FindEq(const Napi::CallbackInfo& info);
+  void FindGe(const Napi::CallbackInfo& info);
+  void FindFirst(const Napi::CallbackInfo& info);
+  void FindLast(const Napi::CallbackInfo& info);
+  void Update(const Napi::CallbackInfo& info);
+  void Write(const Napi::CallbackInfo& info);
+  void Delete(const Napi::CallbackInfo& info);
+
+  /* Private methods */
+  void Dispatch(const Napi::CallbackInfo& info, Method method);
+
+  /* Data */
+  static Napi::FunctionReference constructor_;
+  Napi::Env env_;
+  Napi::ObjectReference fileref_;
+  VsamFile* file_;
+  std::shared_ptr<VsamFile::Position> pos_;
+};
@@ -4,16 +4,38 @@
  * US Government Users Restricted Rights - Use, duplication or disclosure restricted by GSA ADP Schedule Contract with IBM Corp.
 */
 #include "VsamFile.h"
+#include "VsamCursor.h"
+#include "VsamRegistry.h"
+#include "VsamSnapshot.h"
+#include "VsamTrace.h"
+#include "VsamChangeLog.h"
+#include "VsamKeyFilter.h"
 #include <node_buffer.h>
 #include <unistd.h>
 #include <dynit.h>
 #include <sstream>
 #include <numeric>
+#include <algorithm>
 
 Napi::FunctionReference VsamFile::constructor_;
 
 static const char* hexstrToBuffer (char* hexbuf, int buflen, const char* hexstr);
 static const char* bufferToHexstr (char* hexstr, const char* hexbuf, const int hexbuflen);
+static double fieldToNumber (const char* buf, int len, bool binary);
+
+// Records visited per deleteRange() work item, between progress reports
+static const size_t kPurgeBatch = 10000;
+
+static std::string& createAmrcMsg (std::string& errmsg, const char* title) {
+  // __amrc is per thread: call on the thread that issued the failing request
+  __amrc_type currErr = *__amrc;
+  char ebuf[64];
+  sprintf(ebuf, " (R15=%d, reason=%d)", currErr.__code.__feedback.__rc,
+          currErr.__code.__feedback.__fdbk);
+  errmsg = title;
+  errmsg += ebuf;
+  return errmsg;
+}
 
 static void print_amrc() {
   __amrc_type currErr = *__amrc;
@@ -34,7 +56,8 @@ void VsamFile::DeleteCallback(uv_work_t* req, int status) {
 
   Napi::HandleScope scope(obj->env_);
   if (obj->lastrc_ != 0) {
-    obj->cb_.Call(obj->env_.Global(), {Napi::String::New(obj->env_, "Failed to delete")});
+    obj->cb_.Call(obj->env_.Global(), {Napi::String::New(obj->env_, obj->errmsg_)});
+    obj->errmsg_.clear();
     obj->lastrc_ = 0;
   }
   else
@@ -50,7 +73,9 @@ void VsamFile::WriteCallback(uv_work_t* req, int status) {
 
   Napi::HandleScope scope(obj->env_);
   if (obj->lastrc_ != obj->reclen_) {
-    obj->cb_.Call(obj->env_.Global(), {Napi::String::New(obj->env_,"Failed to write")});
+    std::string errmsg(obj->errmsg_.empty() ? "Failed to write" : obj->errmsg_);
+    obj->errmsg_.clear();
+    obj->cb_.Call(obj->env_.Global(), {Napi::String::New(obj->env_, errmsg)});
   }
   else {
     obj->cb_.Call(obj->env_.Global(), {obj->env_.Null()});
@@ -67,7 +92,34 @@ void VsamFile::UpdateCallback(uv_work_t* req, int status) {
     return;
 
   Napi::HandleScope scope(obj->env_);
-  obj->cb_.Call(obj->env_.Global(), {obj->env_.Null()});
+  if (obj->lastrc_ != 0) {
+    obj->cb_.Call(obj->env_.Global(), {Napi::String::New(obj->env_, obj->errmsg_)});
+    obj->errmsg_.clear();
+    obj->lastrc_ = 0;
+  }
+  else
+    obj->cb_.Call(obj->env_.Global(), {obj->env_.Null()});
+}
+
+
+Napi::Value VsamFile::DecodeField(Napi::Env env, const LayoutItem& item, const char* buf) {
+  if (item.type == LayoutItem::HEXADECIMAL) {
+    char hexstr[(item.maxLength*2)+1];
+    bufferToHexstr(hexstr, buf, item.maxLength);
+    return Napi::String::New(env, hexstr);
+  }
+  std::string str(buf, item.maxLength);
+  return Napi::String::New(env, str.c_str());
+}
+
+
+Napi::Object VsamFile::DecodeRecord(Napi::Env env, const std::vector<LayoutItem>& layout, const char* buf) {
+  Napi::Object record = Napi::Object::New(env);
+  for(auto i = layout.begin(); i != layout.end(); ++i) {
+    record.Set(&(i->name[0]), DecodeField(env, *i, buf));
+    buf += i->maxLength;
+  }
+  return record;
 }
 
 
@@ -82,20 +134,9 @@ void VsamFile::ReadCallback(uv_work_t* req, int status) {
 
   if (buf != NULL) {
     Napi::HandleScope scope(obj->env_);
-    Napi::Object record = Napi::Object::New(obj->env_);
-    for(auto i = obj->layout_.begin(); i != obj->layout_.end(); ++i) {
-      if (i->type == LayoutItem::STRING) { 
-        std::string str(buf,i->maxLength+1);
-        str[i->maxLength] = 0;
-        record.Set(&(i->name[0]), Napi::String::New(obj->env_, str.c_str()));
-      }
-      else if (i->type == LayoutItem::HEXADECIMAL) { 
-        char hexstr[(i->maxLength*2)+1];
-        bufferToHexstr(hexstr, buf, i->maxLength);
-        record.Set(&(i->name[0]), Napi::String::New(obj->env_, hexstr));
-      }
-      buf += i->maxLength;
-    }
+    uint64_t t = VsamTrace::Begin();
+    Napi::Object record = DecodeRecord(obj->env_, obj->layout_, buf);
+    VsamTrace::End(t, "decode", obj->opname_, obj->path_, obj->opkeylen_, false);
     obj->cb_.Call(obj->env_.Global(), {record, obj->env_.Null()});
   }
   else {
@@ -105,523 +146,2333 @@ void VsamFile::ReadCallback(uv_work_t* req, int status) {
 }
 
 
-void VsamFile::Find(uv_work_t* req) {
-  VsamFile* obj = (VsamFile*)(req->data);
-  int rc;
-  const char* buf;
-  int buflen;
-  if (obj->keybuf_) {
-    if (obj->keybuf_len_==0) {
-      Napi::TypeError::New(obj->env_, "find: Buffer object is empty.").ThrowAsJavaScriptException();
-      return;
-    }
-    buf = obj->keybuf_;
-    buflen = obj->keybuf_len_;
-  } else {
-    LayoutItem& key_layout = obj->layout_[obj->key_i_];
-    if (key_layout.type == LayoutItem::HEXADECIMAL) {
-      char buf[key_layout.maxLength+1];
-      hexstrToBuffer(buf, sizeof(buf), obj->key_.c_str());
-      rc = flocate(obj->stream_, buf, obj->keylen_, obj->equality_);
-      goto chk;
-    } else {
-      buf = obj->key_.c_str();
-      buflen = obj->keylen_;
-    }
+void VsamFile::Reposition(bool restore) {
+  // Back-to-back ops through the same handle or cursor find the stream where
+  // they left it; only a switch of owner costs a locate.
+  if (owner_ == cur_)
+    return;
+  owner_ = cur_;
+  if (!restore)
+    return;
+
+  char buf[reclen_];
+  Position& pos = *cur_;
+  uint64_t t = VsamTrace::Begin();
+  switch (pos.state) {
+    case Position::START:
+      flocate(stream_, &pos.key[0], keylen_, __KEY_FIRST);
+      TraceIO(t, "flocate");
+      break;
+    case Position::AT_RECORD:
+      // Re-read the record so that update/delete act on it and read returns
+      // the next one; if it has since been deleted, stop before its successor.
+      if (flocate(stream_, &pos.key[0], keylen_, __KEY_EQ) == 0) {
+        TraceIO(t, "flocate");
+        t = VsamTrace::Begin();
+        fread(buf, reclen_, 1, stream_);
+        TraceIO(t, "fread");
+      } else {
+        TraceIO(t, "flocate");
+        t = VsamTrace::Begin();
+        flocate(stream_, &pos.key[0], keylen_, __KEY_GE);
+        TraceIO(t, "flocate");
+      }
+      break;
+    case Position::AFTER_DELETE:
+      flocate(stream_, &pos.key[0], keylen_, __KEY_GE);
+      TraceIO(t, "flocate");
+      break;
+    case Position::AT_END:
+      if (flocate(stream_, &pos.key[0], keylen_, __KEY_LAST) == 0) {
+        TraceIO(t, "flocate");
+        t = VsamTrace::Begin();
+        fread(buf, reclen_, 1, stream_);
+        TraceIO(t, "fread");
+      } else {
+        TraceIO(t, "flocate");
+      }
+      break;
+    case Position::NONE:
+      // Read, update and delete fail without touching the stream
+      break;
   }
-  rc = flocate(obj->stream_, buf, buflen, obj->equality_);
+}
 
-chk: 
-  if (rc==0) {
-    char buf[obj->reclen_];
-    int ret = fread(buf, obj->reclen_, 1, obj->stream_);
-    //TODO: if read fails
-    if (ret == 1) {
-      if (obj->buf_) {
-        free(obj->buf_);
+
+void VsamFile::SavePosition(Position::State state, const char* record) {
+  cur_->state = state;
+  if (record != NULL)
+    memcpy(&cur_->key[0], record + keyoff_, keylen_);
+}
+
+
+bool VsamFile::LocateRecord(const char* key, char* record) {
+  uint64_t t = VsamTrace::Begin();
+  bool found = flocate(stream_, key, keylen_, __KEY_EQ) == 0;
+  TraceIO(t, "flocate");
+  if (!found)
+    return false;
+  t = VsamTrace::Begin();
+  found = fread(record, reclen_, 1, stream_) == 1;
+  TraceIO(t, "fread");
+  return found;
+}
+
+
+void VsamFile::TraceQueue(const char* op, unsigned keylen) {
+  opname_ = op;
+  opkeylen_ = keylen;
+  queued_ = VsamTrace::Begin();
+}
+
+
+void VsamFile::TraceWork() {
+  // Time spent waiting for a worker thread
+  VsamTrace::End(queued_, "queue", opname_, path_, opkeylen_, false);
+}
+
+
+void VsamFile::TraceIO(uint64_t start, const char* call) {
+  VsamTrace::End(start, call, opname_, path_, opkeylen_, true);
+}
+
+
+void VsamFile::PatchRecord(char* record, const KeyedOp& op) {
+  // The key identifies the record, so it is never patched
+  unsigned off = 0;
+  for (size_t n = 0; n < layout_.size(); ++n) {
+    if (op.mask[n] && (int)n != key_i_)
+      memcpy(record + off, &op.record[off], layout_[n].maxLength);
+    off += layout_[n].maxLength;
+  }
+}
+
+
+bool VsamFile::ApplyOp(KeyedOp& op) {
+  char rec[reclen_];
+  switch (op.type) {
+    case KeyedOp::WRITE:
+      if (IndexConflict(&op.record[0], op.errmsg))
+        return false;
+      if (fwrite(&op.record[0], 1, reclen_, stream_) != reclen_) {
+        createAmrcMsg(op.errmsg, "Failed to write");
+        return false;
       }
-      obj->buf_ = malloc(obj->reclen_);
-      //TODO: if malloc fails
-      memcpy(obj->buf_, buf, obj->reclen_);
-      return;
-    }
+      Changed(NULL, &op.record[0]);
+      break;
+    case KeyedOp::UPDATE:
+      if (!LocateRecord(&op.key[0], rec)) {
+        createAmrcMsg(op.errmsg, "Record not found");
+        return false;
+      }
+      op.before.assign(rec, rec + reclen_);
+      PatchRecord(rec, op);
+      if (IndexConflict(rec, op.errmsg))
+        return false;
+      if (fupdate(rec, reclen_, stream_) == 0) {
+        createAmrcMsg(op.errmsg, "Failed to update");
+        return false;
+      }
+      Changed(&op.before[0], rec);
+      break;
+    case KeyedOp::DELETE:
+      if (!LocateRecord(&op.key[0], rec)) {
+        createAmrcMsg(op.errmsg, "Record not found");
+        return false;
+      }
+      op.before.assign(rec, rec + reclen_);
+      if (fdelrec(stream_) != 0) {
+        createAmrcMsg(op.errmsg, "Failed to delete");
+        return false;
+      }
+      Changed(&op.before[0], NULL);
+      break;
+    case KeyedOp::UPSERT:
+      if (IndexConflict(&op.record[0], op.errmsg))
+        return false;
+      if (LocateRecord(&op.key[0], rec)) {
+        op.before.assign(rec, rec + reclen_);
+        if (fupdate(&op.record[0], reclen_, stream_) == 0) {
+          createAmrcMsg(op.errmsg, "Failed to update");
+          return false;
+        }
+        Changed(&op.before[0], &op.record[0]);
+      } else if (fwrite(&op.record[0], 1, reclen_, stream_) != reclen_) {
+        createAmrcMsg(op.errmsg, "Failed to write");
+        return false;
+      } else {
+        Changed(NULL, &op.record[0]);
+      }
+      break;
   }
-  if (obj->buf_) {
-    free(obj->buf_);
-    obj->buf_ = NULL;
+  op.done = true;
+  return true;
+}
+
+
+bool VsamFile::UndoOp(KeyedOp& op) {
+  // Put back the before-image captured by ApplyOp, or remove what it added
+  char rec[reclen_];
+  bool ok;
+  if (op.type == KeyedOp::DELETE) {
+    ok = fwrite(&op.before[0], 1, reclen_, stream_) == reclen_;
+    if (ok)
+      Changed(NULL, &op.before[0]);
+  } else if (!LocateRecord(&op.key[0], rec)) {
+    ok = false;
+  } else if (op.before.empty()) {
+    ok = fdelrec(stream_) == 0;
+    if (ok)
+      Changed(rec, NULL);
+  } else {
+    ok = fupdate(&op.before[0], reclen_, stream_) != 0;
+    if (ok)
+      Changed(rec, &op.before[0]);
   }
-  if (obj->keybuf_) {
-    free(obj->keybuf_);
-    obj->keybuf_ = NULL;
+
+  if (ok)
+    op.errmsg = "Undone";
+  else
+    createAmrcMsg(op.errmsg, "Failed to undo");
+  return ok;
+}
+
+
+bool VsamFile::Indexed() {
+  uv_mutex_lock(&indexmutex_);
+  bool indexed = !indexes_.empty();
+  uv_mutex_unlock(&indexmutex_);
+  return indexed;
+}
+
+
+bool VsamFile::IndexConflict(const char* record, std::string& errmsg) {
+  bool conflict = false;
+  uv_mutex_lock(&indexmutex_);
+  for (auto i = indexes_.begin(); i != indexes_.end(); ++i) {
+    if (i->Conflicts(record)) {
+      errmsg = "Duplicate value for unique index on " + i->Name();
+      conflict = true;
+      break;
+    }
   }
+  uv_mutex_unlock(&indexmutex_);
+  return conflict;
 }
 
-void VsamFile::Read(uv_work_t* req) {
-  VsamFile* obj = (VsamFile*)(req->data);
-  char buf[obj->reclen_];
-  int ret = fread(buf, obj->reclen_, 1, obj->stream_);
-  //TODO: if read fails
-  if (ret == 1) {
-    obj->buf_ = malloc(obj->reclen_);
-    //TODO: if malloc fails
-    memcpy(obj->buf_, buf, obj->reclen_);
-    return;
+
+void VsamFile::IndexReplace(const char* before, const char* after) {
+  uv_mutex_lock(&indexmutex_);
+  for (auto i = indexes_.begin(); i != indexes_.end(); ++i)
+    i->Replace(before, after);
+  uv_mutex_unlock(&indexmutex_);
+}
+
+
+bool VsamFile::Tracked() {
+  // Pick up a change log or key filter installed through another handle since
+  // our last op. Returns whether a change needs the record's before-image; the
+  // key filter only needs the key.
+  unsigned generation = VsamChangeLog::Generation();
+  if (generation != changesgen_) {
+    changes_ = VsamChangeLog::Find(path_);
+    changesgen_ = generation;
   }
-  if (obj->buf_) {
-    free(obj->buf_);
-    obj->buf_ = NULL;
+  generation = VsamKeyFilter::Generation();
+  if (generation != filtergen_) {
+    filter_ = VsamKeyFilter::Find(path_);
+    filtergen_ = generation;
   }
-  if (obj->keybuf_) {
-    free(obj->keybuf_);
-    obj->keybuf_ = NULL;
+  return changes_ || Indexed();
+}
+
+
+void VsamFile::Changed(const char* before, const char* after) {
+  IndexReplace(before, after);
+  if (changes_)
+    changes_->Append(before, after);
+  if (!before)
+    KeyChanged(after + keyoff_, true);
+  else if (!after)
+    KeyChanged(before + keyoff_, false);
+}
+
+
+void VsamFile::KeyChanged(const char* key, bool added) {
+  // A filter installed after Tracked() may have started its scan before this
+  // change was made, and missed it: look again now the change is done. A write
+  // is added to the new filter; a delete is not removed from it, as its scan
+  // can't be known to have counted the key, and a stray count is harmless.
+  std::shared_ptr<VsamKeyFilter> filter = filter_;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  unsigned generation = VsamKeyFilter::Generation();
+  if (generation != filtergen_) {
+    filter_ = VsamKeyFilter::Find(path_);
+    filtergen_ = generation;
   }
+  if (!filter_)
+    return;
+  if (added)
+    filter_->Add(key);
+  else if (filter == filter_ && !filter_->Remove(key))
+    VsamKeyFilter::Drop(path_, filter_);
 }
 
 
-void VsamFile::Delete(uv_work_t* req) {
+void VsamFile::Has(uv_work_t* req) {
   VsamFile* obj = (VsamFile*)(req->data);
-  obj->lastrc_ = fdelrec(obj->stream_);
+  obj->TraceWork();
+  obj->Tracked();
+  // Until it is built the filter can't tell a miss
+  VsamKeyFilter* filter = obj->filter_ && obj->filter_->Ready() ? obj->filter_.get() : NULL;
+  size_t n = obj->probes_.size() / obj->keylen_;
+  obj->found_.assign(n, false);
+  for (size_t i = 0; i < n; ++i) {
+    const char* key = &obj->probes_[i * obj->keylen_];
+    if (filter && !filter->MayContain(key))
+      continue;
+    uint64_t t = VsamTrace::Begin();
+    obj->found_[i] = flocate(obj->stream_, key, obj->keylen_, __KEY_EQ) == 0;
+    obj->TraceIO(t, "flocate");
+  }
+  obj->owner_.reset();
 }
 
 
-void VsamFile::Write(uv_work_t* req) {
+void VsamFile::HasCallback(uv_work_t* req, int status) {
   VsamFile* obj = (VsamFile*)(req->data);
-  obj->lastrc_ = fwrite(obj->buf_, 1, obj->reclen_, obj->stream_);
-  if (obj->buf_) {
-    free(obj->buf_);
-    obj->buf_ = NULL;
-  }
-  if (obj->keybuf_) {
-    free(obj->keybuf_);
-    obj->keybuf_ = NULL;
+  delete req;
+
+  if (status == UV_ECANCELED)
+    return;
+
+  Napi::HandleScope scope(obj->env_);
+  Napi::Value result;
+  if (obj->many_) {
+    Napi::Array found = Napi::Array::New(obj->env_, obj->found_.size());
+    for (size_t i = 0; i < obj->found_.size(); ++i)
+      found.Set(i, Napi::Boolean::New(obj->env_, obj->found_[i]));
+    result = found;
+  } else {
+    result = Napi::Boolean::New(obj->env_, obj->found_[0]);
   }
+  obj->probes_.clear();
+  obj->cb_.Call(obj->env_.Global(), {result, obj->env_.Null()});
 }
 
 
-void VsamFile::Update(uv_work_t* req) {
+void VsamFile::Keys(uv_work_t* req) {
   VsamFile* obj = (VsamFile*)(req->data);
-  int ret = fupdate(obj->buf_, obj->reclen_, obj->stream_);
-  if (ret == 0) {
-    //TODO: error
-  }
-  free(obj->buf_);
-  obj->buf_ = NULL;
-  if (obj->keybuf_) {
-    free(obj->keybuf_);
-    obj->keybuf_ = NULL;
+  obj->TraceWork();
+  // A record I/O read shorter than the record is truncated, so each fread
+  // moves only the bytes up to the end of the key
+  char rec[obj->keyoff_ + obj->keylen_];
+  obj->keys_.clear();
+  if (obj->LocateRange(obj->range_)) {
+    while (fread(rec, sizeof(rec), 1, obj->stream_) == 1) {
+      if (!obj->InRange(obj->range_, rec + obj->keyoff_))
+        break;
+      obj->keys_.insert(obj->keys_.end(), rec + obj->keyoff_, rec + sizeof(rec));
+    }
   }
+  obj->owner_.reset();
 }
 
 
-void VsamFile::Dealloc(uv_work_t* req) {
+void VsamFile::KeysCallback(uv_work_t* req, int status) {
   VsamFile* obj = (VsamFile*)(req->data);
+  delete req;
 
-  std::ostringstream dataset;
-  dataset << "//'" << obj->path_.c_str() << "'";
+  if (status == UV_ECANCELED)
+    return;
 
-  obj->lastrc_ = remove(dataset.str().c_str());
+  Napi::HandleScope scope(obj->env_);
+  size_t n = obj->keys_.size() / obj->keylen_;
+  Napi::Array keys = Napi::Array::New(obj->env_, n);
+  for (size_t i = 0; i < n; ++i)
+    keys.Set(i, DecodeField(obj->env_, obj->layout_[obj->key_i_], &obj->keys_[i * obj->keylen_]));
+  std::vector<char>().swap(obj->keys_);
+  obj->cb_.Call(obj->env_.Global(), {keys, obj->env_.Null()});
 }
 
 
-void VsamFile::DeallocCallback(uv_work_t* req, int status) {
+void VsamFile::BuildKeyFilter(uv_work_t* req) {
+  VsamFile* obj = (VsamFile*)(req->data);
+  obj->TraceWork();
+  VsamKeyFilter& filter = *obj->keyfilter_;
+  uint64_t start = uv_hrtime();
+  // Installed first so writes through other handles during the scan count
+  VsamKeyFilter::Install(obj->path_, obj->keyfilter_);
+  char rec[obj->keyoff_ + obj->keylen_];
+  obj->filterkeys_ = 0;
+  uint64_t t = VsamTrace::Begin();
+  bool found = flocate(obj->stream_, rec, obj->keylen_, __KEY_FIRST) == 0;
+  obj->TraceIO(t, "flocate");
+  if (found) {
+    while (fread(rec, sizeof(rec), 1, obj->stream_) == 1) {
+      filter.Scanned(rec + obj->keyoff_);
+      obj->filterkeys_++;
+    }
+  }
+  filter.Built();
+  obj->buildms_ = (uv_hrtime() - start) / 1e6;
+  obj->owner_.reset();
+}
+
+
+void VsamFile::BuildKeyFilterCallback(uv_work_t* req, int status) {
   VsamFile* obj = (VsamFile*)(req->data);
   delete req;
 
+  if (status == UV_ECANCELED)
+    return;
+
   Napi::HandleScope scope(obj->env_);
+  Napi::Object stats = Napi::Object::New(obj->env_);
+  stats.Set("keys", Napi::Number::New(obj->env_, obj->filterkeys_));
+  stats.Set("hashes", Napi::Number::New(obj->env_, obj->keyfilter_->Hashes()));
+  stats.Set("bytes", Napi::Number::New(obj->env_, obj->keyfilter_->Bytes()));
+  stats.Set("buildTime", Napi::Number::New(obj->env_, obj->buildms_));
+  obj->keyfilter_.reset();
+  obj->cb_.Call(obj->env_.Global(), {stats, obj->env_.Null()});
+}
+
+
+void VsamFile::DeleteRange(uv_work_t* req) {
+  VsamFile* obj = (VsamFile*)(req->data);
+  obj->TraceWork();
+  obj->Tracked();
+  Purge& purge = obj->purge_;
+  char rec[obj->reclen_];
+  size_t batch = 0;
+  if (!obj->LocateRange(purge.range))
+    purge.done = true;
+  while (!purge.done && batch < kPurgeBatch) {
+    if (purge.limit && purge.count == purge.limit) {
+      purge.done = true;
+      break;
+    }
+    uint64_t t = VsamTrace::Begin();
+    int ret = fread(rec, obj->reclen_, 1, obj->stream_);
+    obj->TraceIO(t, "fread");
+    if (ret != 1 && ferror(obj->stream_)) {
+      // Not the end of the dataset: the range may go on past this point
+      purge.rc = __amrc->__code.__feedback.__rc;
+      purge.fdbk = __amrc->__code.__feedback.__fdbk;
+      createAmrcMsg(purge.errmsg, "Failed to read");
+      clearerr(obj->stream_);
+      purge.failed = true;
+      purge.readerr = true;
+      purge.done = true;
+      break;
+    }
+    if (ret != 1 || !obj->InRange(purge.range, rec + obj->keyoff_)) {
+      purge.done = true;
+      break;
+    }
+    purge.range.start.assign(rec + obj->keyoff_, rec + obj->keyoff_ + obj->keylen_);
+    purge.last = purge.range.start;
+    if (!purge.dryRun) {
+      t = VsamTrace::Begin();
+      int rc = fdelrec(obj->stream_);
+      obj->TraceIO(t, "fdelrec");
+      if (rc != 0) {
+        purge.rc = __amrc->__code.__feedback.__rc;
+        purge.fdbk = __amrc->__code.__feedback.__fdbk;
+        createAmrcMsg(purge.errmsg, "Failed to delete");
+        purge.failed = true;
+        purge.done = true;
+        break;
+      }
+      obj->Changed(rec, NULL);
+    }
+    purge.count++;
+    batch++;
+  }
+
+  // The next batch starts just past the last key visited
+  if (!purge.done) {
+    int i = obj->keylen_ - 1;
+    while (i >= 0 && (unsigned char)purge.range.start[i] == 0xff)
+      purge.range.start[i--] = 0;
+    if (i < 0)
+      purge.done = true;
+    else
+      purge.range.start[i]++;
+    purge.range.from_first = false;
+  }
+  obj->owner_.reset();
+}
+
+
+void VsamFile::DeleteRangeCallback(uv_work_t* req, int status) {
+  VsamFile* obj = (VsamFile*)(req->data);
+
   if (status == UV_ECANCELED) {
+    delete req;
     return;
   }
-  else if (obj->lastrc_ != 0) {
-    obj->cb_.Call(obj->env_.Global(), {Napi::String::New(obj->env_, "Couldn't deallocate dataset")});
+
+  Napi::HandleScope scope(obj->env_);
+  Purge& purge = obj->purge_;
+  if (!purge.done) {
+    // Let the event loop run, report progress and queue the next batch
+    if (!obj->progress_.IsEmpty())
+      obj->progress_.Call(obj->env_.Global(), {Napi::Number::New(obj->env_, purge.count)});
+    obj->TraceQueue("deleteRange", obj->keylen_);
+    uv_queue_work(uv_default_loop(), req, DeleteRange, DeleteRangeCallback);
+    return;
   }
-  else {
-    obj->cb_.Call(obj->env_.Global(), {obj->env_.Null()});
+  delete req;
+
+  Napi::Object result = Napi::Object::New(obj->env_);
+  result.Set(purge.dryRun ? "matched" : "deleted", Napi::Number::New(obj->env_, purge.count));
+  if (!obj->progress_.IsEmpty())
+    obj->progress_.Reset();
+  if (purge.failed) {
+    if (!purge.readerr)
+      result.Set("failedKey", DecodeField(obj->env_, obj->layout_[obj->key_i_],
+                                          &purge.range.start[0]));
+    result.Set("lastKey", purge.last.empty() ? obj->env_.Null()
+               : DecodeField(obj->env_, obj->layout_[obj->key_i_], &purge.last[0]));
+    Napi::Object feedback = Napi::Object::New(obj->env_);
+    feedback.Set("rc", Napi::Number::New(obj->env_, purge.rc));
+    feedback.Set("reason", Napi::Number::New(obj->env_, purge.fdbk));
+    result.Set("feedback", feedback);
+    obj->cb_.Call(obj->env_.Global(), {result, Napi::String::New(obj->env_, purge.errmsg)});
   }
+  else
+    obj->cb_.Call(obj->env_.Global(), {result, obj->env_.Null()});
 }
 
 
-static std::string& createErrorMsg (std::string& errmsg, int err, int err2, const char* title) {
-  // err is errno, err2 is __errno2()
-  errmsg = title;
-  std::string e(strerror(err));
-  if (!e.empty())
-    errmsg += ": " + e;
-  if (err2) {
-    char ebuf[32];
-    sprintf(ebuf, " (errno2=0x%08x)", err2);
-    errmsg += ebuf;
+void VsamFile::CreateIndex(uv_work_t* req) {
+  VsamFile* obj = (VsamFile*)(req->data);
+  obj->TraceWork();
+  VsamIndex& index = *obj->building_;
+  uint64_t start = uv_hrtime();
+  char key[obj->keylen_];
+  char rec[obj->reclen_];
+  obj->lastrc_ = 0;
+  uint64_t t = VsamTrace::Begin();
+  bool found = flocate(obj->stream_, key, obj->keylen_, __KEY_FIRST) == 0;
+  obj->TraceIO(t, "flocate");
+  if (found) {
+    while (fread(rec, obj->reclen_, 1, obj->stream_) == 1) {
+      if (!index.Add(rec)) {
+        obj->errmsg_ = "Duplicate value for unique index on " + index.Name();
+        obj->lastrc_ = -1;
+        break;
+      }
+    }
   }
-  return errmsg;
+  obj->buildms_ = (uv_hrtime() - start) / 1e6;
+  obj->owner_.reset();
 }
 
 
-static bool isDatasetExist (const char* path, int* perr=0, int* perr2=0 ) {
-  FILE *stream = fopen(path, "rb,type=record");
-  int err2 = __errno2();
-  if (perr) *perr = errno;
-  if (perr2) *perr2 = err2;
-  if (stream != NULL) {
-    fclose(stream);
-    return true;
-  }
-  if (err2 == 0xC00B0641) {
-    // 0xC00B0641 is file not found
-    return false;
-  }
-  if (err2 == 0xC00A0022) {
-    // 0xC00A0022 could be if opening an empty dataset as read-only, double-check:
-    stream = fopen(path, "rb+,type=record");
-    if (perr) *perr = errno;
-    if (perr2) *perr2 = __errno2();
-    if (stream == NULL)
-      return false;
-    fclose(stream);
-    return true;
-  }
-  return false;
-}
+void VsamFile::CreateIndexCallback(uv_work_t* req, int status) {
+  VsamFile* obj = (VsamFile*)(req->data);
+  delete req;
 
+  if (status == UV_ECANCELED)
+    return;
 
-VsamFile::VsamFile(const Napi::CallbackInfo& info)
-: Napi::ObjectWrap<VsamFile>(info),
-    env_(info.Env()),
-    stream_(NULL),
-    keylen_(-1),
-    lastrc_(-1),
-    buf_(NULL),
-    keybuf_(NULL),
-    keybuf_len_(0) {
-  Napi::HandleScope scope(env_);
-  int err, err2;
+  Napi::HandleScope scope(obj->env_);
+  std::unique_ptr<VsamIndex> index(obj->building_.release());
+  if (obj->lastrc_ != 0) {
+    obj->cb_.Call(obj->env_.Global(), {obj->env_.Null(), Napi::String::New(obj->env_, obj->errmsg_)});
+    obj->lastrc_ = 0;
+    return;
+  }
 
-  if (info.Length() != 5) {
-    Napi::Error::New(env_, "Wrong number of arguments to VsamFile::VsamFile")
-        .ThrowAsJavaScriptException();
+  Napi::Object stats = Napi::Object::New(obj->env_);
+  stats.Set("field", Napi::String::New(obj->env_, index->Name()));
+  stats.Set("unique", Napi::Boolean::New(obj->env_, index->Unique()));
+  stats.Set("entries", Napi::Number::New(obj->env_, index->Entries()));
+  stats.Set("bytes", Napi::Number::New(obj->env_, index->Bytes()));
+  stats.Set("buildTime", Napi::Number::New(obj->env_, obj->buildms_));
+
+  // Rebuilding an index replaces the old one
+  uv_mutex_lock(&obj->indexmutex_);
+  auto i = obj->indexes_.begin();
+  while (i != obj->indexes_.end() && i->Name() != index->Name())
+    ++i;
+  if (i != obj->indexes_.end())
+    *i = std::move(*index);
+  else
+    obj->indexes_.push_back(std::move(*index));
+  uv_mutex_unlock(&obj->indexmutex_);
+  obj->cb_.Call(obj->env_.Global(), {stats, obj->env_.Null()});
+}
+
+
+void VsamFile::FindBy(uv_work_t* req) {
+  VsamFile* obj = (VsamFile*)(req->data);
+  obj->TraceWork();
+  obj->Reposition(false);
+  std::string key;
+  // The index may have been dropped since findBy() was called
+  bool found = false;
+  uv_mutex_lock(&obj->indexmutex_);
+  for (auto i = obj->indexes_.begin(); i != obj->indexes_.end(); ++i) {
+    if (i->Name() == obj->findname_) {
+      found = i->Lookup(obj->findvalue_.data(), key);
+      break;
+    }
+  }
+  uv_mutex_unlock(&obj->indexmutex_);
+
+  // Read straight into the record handed to ReadCallback; running out of
+  // memory fails the lookup like a missing record
+  if (obj->buf_)
+    free(obj->buf_);
+  obj->buf_ = found ? malloc(obj->reclen_) : NULL;
+  if (obj->buf_ && obj->LocateRecord(key.data(), (char*)obj->buf_)) {
+    obj->SavePosition(Position::AT_RECORD, (const char*)obj->buf_);
     return;
   }
+  obj->SavePosition(Position::NONE, NULL);
+  if (obj->buf_) {
+    free(obj->buf_);
+    obj->buf_ = NULL;
+  }
+}
 
-  path_ = static_cast<std::string>(info[0].As<Napi::String>());
-  Napi::Buffer<std::vector<LayoutItem>> b = info[1].As<Napi::Buffer<std::vector<LayoutItem>>>();
-  layout_ = *(static_cast<std::vector<LayoutItem>*>(b.Data()));
-  bool alloc(static_cast<bool>(info[2].As<Napi::Boolean>()));
-  key_i_ = static_cast<int>(info[3].As<Napi::Number>().Int32Value());
-  omode_ = static_cast<std::string>(info[4].As<Napi::String>());
 
-  std::ostringstream dataset;
-  dataset << "//'" << path_.c_str() << "'";
+void VsamFile::Apply(uv_work_t* req) {
+  VsamFile* obj = (VsamFile*)(req->data);
+  obj->TraceWork();
+  obj->Tracked();
+  std::vector<KeyedOp>& ops = obj->ops_;
+  int failed = 0;
+  obj->lastrc_ = 0;
+  for (size_t i = 0; i < ops.size(); ++i) {
+    if (obj->ApplyOp(ops[i]))
+      continue;
+    failed++;
+    if (!obj->atomic_)
+      continue;
+
+    std::ostringstream msg;
+    msg << "Operation " << i << " failed: " << ops[i].errmsg;
+    bool undone = true;
+    for (size_t j = i; j-- > 0; ) {
+      if (!obj->UndoOp(ops[j])) {
+        msg << "; operation " << j << ": " << ops[j].errmsg;
+        undone = false;
+      }
+    }
+    if (undone && i > 0)
+      msg << "; previous operations were undone";
+    obj->errmsg_ = msg.str();
+    break;
+  }
+  if (failed && !obj->atomic_) {
+    std::ostringstream msg;
+    msg << failed << " of " << ops.size() << " operations failed";
+    obj->errmsg_ = msg.str();
+  }
+  obj->lastrc_ = failed;
 
-  if (!alloc) {
-    stream_ = fopen(dataset.str().c_str(), omode_.c_str());
-    err = errno;
-    err2 = __errno2();
+  // Keyed ops leave the stream somewhere no cursor expects it
+  obj->owner_.reset();
+}
 
-    if (stream_ == NULL) {
-      createErrorMsg(errmsg_, err, err2, "Failed to open dataset");
+
+void VsamFile::MutateByKey(uv_work_t* req) {
+  VsamFile* obj = (VsamFile*)(req->data);
+  obj->TraceWork();
+  obj->Tracked();
+  obj->lastrc_ = obj->ApplyOp(obj->ops_[0]) ? 0 : -1;
+  obj->owner_.reset();
+}
+
+
+void VsamFile::MutateByKeyCallback(uv_work_t* req, int status) {
+  VsamFile* obj = (VsamFile*)(req->data);
+  delete req;
+
+  if (status == UV_ECANCELED)
+    return;
+
+  Napi::HandleScope scope(obj->env_);
+  std::string errmsg;
+  errmsg.swap(obj->ops_[0].errmsg);
+  obj->ops_.clear();
+  if (obj->lastrc_ != 0) {
+    obj->cb_.Call(obj->env_.Global(), {Napi::String::New(obj->env_, errmsg)});
+    obj->lastrc_ = 0;
+  }
+  else
+    obj->cb_.Call(obj->env_.Global(), {obj->env_.Null()});
+}
+
+
+void VsamFile::ApplyCallback(uv_work_t* req, int status) {
+  VsamFile* obj = (VsamFile*)(req->data);
+  delete req;
+
+  if (status == UV_ECANCELED)
+    return;
+
+  Napi::HandleScope scope(obj->env_);
+  Napi::Array results = Napi::Array::New(obj->env_, obj->ops_.size());
+  for (size_t i = 0; i < obj->ops_.size(); ++i) {
+    KeyedOp& op = obj->ops_[i];
+    if (!op.errmsg.empty())
+      results.Set(i, Napi::String::New(obj->env_, op.errmsg));
+    else if (op.done)
+      results.Set(i, obj->env_.Null());
+    else
+      results.Set(i, Napi::String::New(obj->env_, "Not executed"));
+  }
+  obj->ops_.clear();
+
+  if (obj->lastrc_ != 0) {
+    obj->cb_.Call(obj->env_.Global(), {results, Napi::String::New(obj->env_, obj->errmsg_)});
+    obj->lastrc_ = 0;
+  }
+  else
+    obj->cb_.Call(obj->env_.Global(), {results, obj->env_.Null()});
+}
+
+
+bool VsamFile::LocateRange(const KeyRange& range) {
+  uint64_t t = VsamTrace::Begin();
+  bool found = flocate(stream_, &range.start[0], keylen_,
+                       range.from_first ? __KEY_FIRST : __KEY_GE) == 0;
+  TraceIO(t, "flocate");
+  return found;
+}
+
+
+bool VsamFile::InRange(const KeyRange& range, const char* key) {
+  if (range.prefixlen)
+    return memcmp(key, &range.start[0], range.prefixlen) == 0;
+  return range.to_last || memcmp(key, &range.end[0], keylen_) <= 0;
+}
+
+
+void VsamFile::Aggregate(uv_work_t* req) {
+  VsamFile* obj = (VsamFile*)(req->data);
+  obj->TraceWork();
+  Aggregation& agg = obj->agg_;
+  std::vector<Aggregation::Metric>& metrics = agg.metrics;
+  std::vector<unsigned> offsets(metrics.size());
+  for (size_t m = 0; m < metrics.size(); ++m)
+    offsets[m] = metrics[m].field >= 0 ? obj->FieldOffset(metrics[m].field) : 0;
+  unsigned goff = agg.groupBy >= 0 ? obj->FieldOffset(agg.groupBy) : 0;
+  unsigned glen = agg.groupBy >= 0 ? obj->layout_[agg.groupBy].maxLength : 0;
+
+  char rec[obj->reclen_];
+  obj->lastrc_ = 0;
+  if (obj->LocateRange(agg.range)) {
+    while (fread(rec, obj->reclen_, 1, obj->stream_) == 1) {
+      if (!obj->InRange(agg.range, rec + obj->keyoff_))
+        break;
+
+      Aggregation::Group& g = agg.groups[std::string(rec + goff, glen)];
+      if (g.count == 0) {
+        g.sums.resize(metrics.size());
+        g.extremes.resize(metrics.size());
+      }
+      g.count++;
+      for (size_t m = 0; m < metrics.size(); ++m) {
+        const char* field = rec + offsets[m];
+        if (metrics[m].kind == Aggregation::Metric::COUNT)
+          continue;
+        const LayoutItem& item = obj->layout_[metrics[m].field];
+        std::string& extreme = g.extremes[m];
+        switch (metrics[m].kind) {
+          case Aggregation::Metric::SUM:
+            g.sums[m] += fieldToNumber(field, item.maxLength,
+                                       item.type == LayoutItem::HEXADECIMAL);
+            break;
+          case Aggregation::Metric::MIN:
+            if (g.count == 1 || memcmp(field, extreme.data(), item.maxLength) < 0)
+              extreme.assign(field, item.maxLength);
+            break;
+          case Aggregation::Metric::MAX:
+            if (g.count == 1 || memcmp(field, extreme.data(), item.maxLength) > 0)
+              extreme.assign(field, item.maxLength);
+            break;
+          default:
+            break;
+        }
+      }
+    }
+    // fread() returns 0 both at end of file and on error
+    if (ferror(obj->stream_)) {
+      createAmrcMsg(obj->errmsg_, "Failed to read");
+      obj->lastrc_ = -1;
+      clearerr(obj->stream_);
+    }
+  }
+  obj->owner_.reset();
+}
+
+
+void VsamFile::AggregateCallback(uv_work_t* req, int status) {
+  VsamFile* obj = (VsamFile*)(req->data);
+  delete req;
+
+  if (status == UV_ECANCELED)
+    return;
+
+  Napi::HandleScope scope(obj->env_);
+  Aggregation& agg = obj->agg_;
+  if (obj->lastrc_ != 0) {
+    agg.groups.clear();
+    obj->cb_.Call(obj->env_.Global(), {obj->env_.Null(), Napi::String::New(obj->env_, obj->errmsg_)});
+    obj->errmsg_.clear();
+    obj->lastrc_ = 0;
+    return;
+  }
+
+  // Without groupBy there is always one row, even for an empty range
+  if (agg.groupBy < 0 && agg.groups.empty())
+    agg.groups[std::string()];
+  std::vector<std::string> keys;
+  for (auto i = agg.groups.begin(); i != agg.groups.end(); ++i)
+    keys.push_back(i->first);
+  std::sort(keys.begin(), keys.end());
+
+  Napi::Array rows = Napi::Array::New(obj->env_, keys.size());
+  for (size_t r = 0; r < keys.size(); ++r) {
+    Aggregation::Group& g = agg.groups[keys[r]];
+    Napi::Object row = Napi::Object::New(obj->env_);
+    if (agg.groupBy >= 0) {
+      LayoutItem& item = obj->layout_[agg.groupBy];
+      row.Set(&(item.name[0]), DecodeField(obj->env_, item, keys[r].data()));
+    }
+    for (size_t m = 0; m < agg.metrics.size(); ++m) {
+      Aggregation::Metric& metric = agg.metrics[m];
+      if (metric.kind == Aggregation::Metric::COUNT)
+        row.Set(metric.name, Napi::Number::New(obj->env_, g.count));
+      else if (metric.kind == Aggregation::Metric::SUM)
+        row.Set(metric.name, Napi::Number::New(obj->env_, g.count ? g.sums[m] : 0));
+      else if (g.count == 0)
+        row.Set(metric.name, obj->env_.Null());
+      else
+        row.Set(metric.name, DecodeField(obj->env_, obj->layout_[metric.field],
+                                         g.extremes[m].data()));
+    }
+    rows.Set(r, row);
+  }
+  agg.groups.clear();
+  obj->cb_.Call(obj->env_.Global(), {rows, obj->env_.Null()});
+}
+
+
+void VsamFile::Snapshot(uv_work_t* req) {
+  VsamFile* obj = (VsamFile*)(req->data);
+  obj->TraceWork();
+  uint64_t t = VsamTrace::Begin();
+  obj->lastrc_ = VsamSnapshot::Build(obj, obj->snappath_, obj->errmsg_) ? 0 : -1;
+  VsamTrace::End(t, "build", obj->opname_, obj->path_, obj->opkeylen_, false);
+  obj->owner_.reset();
+}
+
+
+void VsamFile::SnapshotCallback(uv_work_t* req, int status) {
+  VsamFile* obj = (VsamFile*)(req->data);
+  delete req;
+
+  if (status == UV_ECANCELED)
+    return;
+
+  Napi::HandleScope scope(obj->env_);
+  if (obj->lastrc_ != 0) {
+    obj->cb_.Call(obj->env_.Global(), {Napi::String::New(obj->env_, obj->errmsg_)});
+    obj->errmsg_.clear();
+    obj->lastrc_ = 0;
+  }
+  else
+    obj->cb_.Call(obj->env_.Global(), {obj->env_.Null()});
+}
+
+
+void VsamFile::Find(uv_work_t* req) {
+  VsamFile* obj = (VsamFile*)(req->data);
+  obj->TraceWork();
+  obj->Reposition(false);
+  uint64_t t;
+  int rc;
+  const char* buf;
+  int buflen;
+  if (obj->keybuf_) {
+    if (obj->keybuf_len_==0) {
+      Napi::TypeError::New(obj->env_, "find: Buffer object is empty.").ThrowAsJavaScriptException();
       return;
     }
+    buf = obj->keybuf_;
+    buflen = obj->keybuf_len_;
   } else {
-    if (isDatasetExist(dataset.str().c_str(),&err,&err2)) {
-      errmsg_ = "Dataset already exists";
-      return;
+    LayoutItem& key_layout = obj->layout_[obj->key_i_];
+    if (key_layout.type == LayoutItem::HEXADECIMAL) {
+      char buf[key_layout.maxLength+1];
+      hexstrToBuffer(buf, sizeof(buf), obj->key_.c_str());
+      t = VsamTrace::Begin();
+      rc = flocate(obj->stream_, buf, obj->keylen_, obj->equality_);
+      obj->TraceIO(t, "flocate");
+      goto chk;
+    } else {
+      buf = obj->key_.c_str();
+      buflen = obj->keylen_;
     }
-    if (err2 != 0xC00B0641) {
-      // 0xC00B0641 is file not found
-      createErrorMsg(errmsg_, err, err2, "Unexpected fopen error");
+  }
+  t = VsamTrace::Begin();
+  rc = flocate(obj->stream_, buf, buflen, obj->equality_);
+  obj->TraceIO(t, "flocate");
+
+chk: 
+  if (rc==0) {
+    char buf[obj->reclen_];
+    t = VsamTrace::Begin();
+    int ret = fread(buf, obj->reclen_, 1, obj->stream_);
+    obj->TraceIO(t, "fread");
+    //TODO: if read fails
+    if (ret == 1) {
+      obj->SavePosition(Position::AT_RECORD, buf);
+      if (obj->buf_) {
+        free(obj->buf_);
+      }
+      obj->buf_ = malloc(obj->reclen_);
+      //TODO: if malloc fails
+      memcpy(obj->buf_, buf, obj->reclen_);
       return;
     }
+  }
+  // Don't leave update or delete acting on the record found before
+  obj->SavePosition(Position::NONE, NULL);
+  if (obj->buf_) {
+    free(obj->buf_);
+    obj->buf_ = NULL;
+  }
+  if (obj->keybuf_) {
+    free(obj->keybuf_);
+    obj->keybuf_ = NULL;
+  }
+}
 
-    std::ostringstream ddname;
-    ddname << "NAMEDD";
+void VsamFile::Read(uv_work_t* req) {
+  VsamFile* obj = (VsamFile*)(req->data);
+  obj->TraceWork();
+  obj->Reposition(true);
+  char buf[obj->reclen_];
+  int ret = 0;
+  if (obj->cur_->state != Position::NONE) {
+    uint64_t t = VsamTrace::Begin();
+    ret = fread(buf, obj->reclen_, 1, obj->stream_);
+    obj->TraceIO(t, "fread");
+  }
+  //TODO: if read fails
+  if (ret == 1) {
+    obj->SavePosition(Position::AT_RECORD, buf);
+    obj->buf_ = malloc(obj->reclen_);
+    //TODO: if malloc fails
+    memcpy(obj->buf_, buf, obj->reclen_);
+    return;
+  }
+  if (obj->cur_->state != Position::NONE)
+    obj->SavePosition(Position::AT_END, NULL);
+  if (obj->buf_) {
+    free(obj->buf_);
+    obj->buf_ = NULL;
+  }
+  if (obj->keybuf_) {
+    free(obj->keybuf_);
+    obj->keybuf_ = NULL;
+  }
+}
 
-    __dyn_t dyn;
-    dyninit(&dyn);
-    dyn.__dsname = &(path_[0]);
-    dyn.__ddname = &(ddname.str()[0]);
-    dyn.__normdisp = __DISP_CATLG;
-    dyn.__lrecl = std::accumulate(layout_.begin(), layout_.end(), 0,
-                                  [](int n, LayoutItem& l) -> int { return n + l.maxLength; });
-    dyn.__keylength = layout_[0].maxLength;
-    dyn.__recorg = __KS;
-    if (dynalloc(&dyn) != 0) {
-      errmsg_ = "Failed to allocate dataset";
-      return;
+
+void VsamFile::Delete(uv_work_t* req) {
+  VsamFile* obj = (VsamFile*)(req->data);
+  obj->TraceWork();
+  obj->Reposition(true);
+  if (obj->cur_->state == Position::NONE) {
+    obj->errmsg_ = "Failed to delete: no current record, the last find failed";
+    obj->lastrc_ = -1;
+    return;
+  }
+  // Restoring a position past the end, or after a delete, leaves some other
+  // record last read; fdelrec() must not remove that one
+  if (obj->cur_->state != Position::AT_RECORD) {
+    obj->errmsg_ = "Failed to delete: no current record";
+    obj->lastrc_ = -1;
+    return;
+  }
+  // Re-read the record so its index entries and before-image go with it
+  char old[obj->reclen_];
+  bool tracked = obj->Tracked() && obj->LocateRecord(&obj->cur_->key[0], old);
+  uint64_t t = VsamTrace::Begin();
+  obj->lastrc_ = fdelrec(obj->stream_);
+  obj->TraceIO(t, "fdelrec");
+  if (obj->lastrc_ != 0)
+    createAmrcMsg(obj->errmsg_, "Failed to delete");
+  if (obj->lastrc_ == 0) {
+    if (tracked)
+      obj->Changed(old, NULL);
+    else
+      obj->KeyChanged(&obj->cur_->key[0], false);
+    obj->SavePosition(Position::AFTER_DELETE, NULL);
+  }
+}
+
+
+void VsamFile::Write(uv_work_t* req) {
+  VsamFile* obj = (VsamFile*)(req->data);
+  obj->TraceWork();
+  obj->Reposition(false);
+  obj->Tracked();
+  if (obj->IndexConflict((const char*)obj->buf_, obj->errmsg_)) {
+    obj->lastrc_ = -1;
+  } else {
+    uint64_t t = VsamTrace::Begin();
+    obj->lastrc_ = fwrite(obj->buf_, 1, obj->reclen_, obj->stream_);
+    obj->TraceIO(t, "fwrite");
+    if (obj->lastrc_ == obj->reclen_) {
+      obj->SavePosition(Position::AT_RECORD, (const char*)obj->buf_);
+      obj->Changed(NULL, (const char*)obj->buf_);
     }
-    stream_ = fopen(dataset.str().c_str(), "ab+,type=record");
-    if (stream_ == NULL) {
-      createErrorMsg(errmsg_, errno, __errno2(), "Failed to open new dataset");
+  }
+  if (obj->buf_) {
+    free(obj->buf_);
+    obj->buf_ = NULL;
+  }
+  if (obj->keybuf_) {
+    free(obj->keybuf_);
+    obj->keybuf_ = NULL;
+  }
+}
+
+
+void VsamFile::Update(uv_work_t* req) {
+  VsamFile* obj = (VsamFile*)(req->data);
+  obj->TraceWork();
+  obj->Reposition(true);
+  // Re-read the record under the cursor for its index entries and before-image;
+  // the new record must have the same key
+  char old[obj->reclen_];
+  bool tracked = false;
+  int ret = 0;
+  obj->lastrc_ = 0;
+  if (obj->cur_->state == Position::NONE) {
+    obj->errmsg_ = "Failed to update: no current record, the last find failed";
+    obj->lastrc_ = -1;
+  } else if (obj->cur_->state != Position::AT_RECORD) {
+    // As for delete, don't overwrite whatever record a reposition last read
+    obj->errmsg_ = "Failed to update: no current record";
+    obj->lastrc_ = -1;
+  } else if (obj->Tracked()) {
+    if (memcmp((const char*)obj->buf_ + obj->keyoff_, &obj->cur_->key[0], obj->keylen_)) {
+      obj->errmsg_ = "Failed to update: the record's key differs from the current record's";
+      obj->lastrc_ = -1;
+    } else if (!obj->LocateRecord(&obj->cur_->key[0], old)) {
+      createAmrcMsg(obj->errmsg_, "Failed to update: current record not found");
+      obj->lastrc_ = -1;
+    } else if (obj->IndexConflict((const char*)obj->buf_, obj->errmsg_)) {
+      obj->lastrc_ = -1;
+    } else {
+      tracked = true;
+    }
+  }
+  if (obj->lastrc_ == 0) {
+    uint64_t t = VsamTrace::Begin();
+    ret = fupdate(obj->buf_, obj->reclen_, obj->stream_);
+    obj->TraceIO(t, "fupdate");
+    if (ret == 0) {
+      createAmrcMsg(obj->errmsg_, "Failed to update");
+      obj->lastrc_ = -1;
+    }
+  }
+  if (obj->lastrc_ == 0 && tracked)
+    obj->Changed(old, (const char*)obj->buf_);
+  free(obj->buf_);
+  obj->buf_ = NULL;
+  if (obj->keybuf_) {
+    free(obj->keybuf_);
+    obj->keybuf_ = NULL;
+  }
+}
+
+
+void VsamFile::Dealloc(uv_work_t* req) {
+  VsamFile* obj = (VsamFile*)(req->data);
+  VsamRegistry::Purge(obj->path_);
+
+  std::ostringstream dataset;
+  dataset << "//'" << obj->path_.c_str() << "'";
+
+  obj->lastrc_ = remove(dataset.str().c_str());
+}
+
+
+void VsamFile::DeallocCallback(uv_work_t* req, int status) {
+  VsamFile* obj = (VsamFile*)(req->data);
+  delete req;
+
+  Napi::HandleScope scope(obj->env_);
+  if (status == UV_ECANCELED) {
+    return;
+  }
+  else if (obj->lastrc_ != 0) {
+    obj->cb_.Call(obj->env_.Global(), {Napi::String::New(obj->env_, "Couldn't deallocate dataset")});
+  }
+  else {
+    obj->cb_.Call(obj->env_.Global(), {obj->env_.Null()});
+  }
+}
+
+
+static std::string& createErrorMsg (std::string& errmsg, int err, int err2, const char* title) {
+  // err is errno, err2 is __errno2()
+  errmsg = title;
+  std::string e(strerror(err));
+  if (!e.empty())
+    errmsg += ": " + e;
+  if (err2) {
+    char ebuf[32];
+    sprintf(ebuf, " (errno2=0x%08x)", err2);
+    errmsg += ebuf;
+  }
+  return errmsg;
+}
+
+
+static bool isDatasetExist (const char* path, int* perr=0, int* perr2=0 ) {
+  FILE *stream = fopen(path, "rb,type=record");
+  int err2 = __errno2();
+  if (perr) *perr = errno;
+  if (perr2) *perr2 = err2;
+  if (stream != NULL) {
+    fclose(stream);
+    return true;
+  }
+  if (err2 == 0xC00B0641) {
+    // 0xC00B0641 is file not found
+    return false;
+  }
+  if (err2 == 0xC00A0022) {
+    // 0xC00A0022 could be if opening an empty dataset as read-only, double-check:
+    stream = fopen(path, "rb+,type=record");
+    if (perr) *perr = errno;
+    if (perr2) *perr2 = __errno2();
+    if (stream == NULL)
+      return false;
+    fclose(stream);
+    return true;
+  }
+  return false;
+}
+
+
+VsamFile::VsamFile(const Napi::CallbackInfo& info)
+: Napi::ObjectWrap<VsamFile>(info),
+    env_(info.Env()),
+    stream_(NULL),
+    keylen_(-1),
+    lastrc_(-1),
+    buf_(NULL),
+    keybuf_(NULL),
+    keybuf_len_(0),
+    registered_(false),
+    opname_(""),
+    opkeylen_(0),
+    queued_(0),
+    changesgen_(0),
+    filtergen_(0),
+    many_(false),
+    filterkeys_(0) {
+  Napi::HandleScope scope(env_);
+  uv_mutex_init(&indexmutex_);
+
+  if (info.Length() != 5 && info.Length() != 6) {
+    Napi::Error::New(env_, "Wrong number of arguments to VsamFile::VsamFile")
+        .ThrowAsJavaScriptException();
+    return;
+  }
+
+  path_ = static_cast<std::string>(info[0].As<Napi::String>());
+  Napi::Buffer<std::vector<LayoutItem>> b = info[1].As<Napi::Buffer<std::vector<LayoutItem>>>();
+  layout_ = *(static_cast<std::vector<LayoutItem>*>(b.Data()));
+  alloc_ = static_cast<bool>(info[2].As<Napi::Boolean>());
+  key_i_ = static_cast<int>(info[3].As<Napi::Number>().Int32Value());
+  omode_ = static_cast<std::string>(info[4].As<Napi::String>());
+  opname_ = alloc_ ? "alloc" : "open";
+
+  // open() and alloc() defer the fopen to the worker pool
+  bool deferred = info.Length() == 6 && static_cast<bool>(info[5].As<Napi::Boolean>());
+  if (!deferred)
+    OpenStream();
+}
+
+
+void VsamFile::OpenStream() {
+  int err, err2;
+  std::ostringstream dataset;
+  dataset << "//'" << path_.c_str() << "'";
+
+  bool reused = false;
+  if (!alloc_) {
+    stream_ = VsamRegistry::Acquire(path_, omode_, &keylen_, &reclen_);
+    reused = stream_ != NULL;
+  }
+
+  if (reused) {
+    registered_ = true;
+  } else if (!alloc_) {
+    uint64_t t = VsamTrace::Begin();
+    stream_ = fopen(dataset.str().c_str(), omode_.c_str());
+    err = errno;
+    err2 = __errno2();
+    VsamTrace::End(t, "fopen", opname_, path_, 0, false);
+
+    if (stream_ == NULL) {
+      createErrorMsg(errmsg_, err, err2, "Failed to open dataset");
+      return;
+    }
+  } else {
+    uint64_t t = VsamTrace::Begin();
+    bool exists = isDatasetExist(dataset.str().c_str(),&err,&err2);
+    VsamTrace::End(t, "exist", opname_, path_, 0, false);
+    if (exists) {
+      errmsg_ = "Dataset already exists";
+      return;
+    }
+    if (err2 != 0xC00B0641) {
+      // 0xC00B0641 is file not found
+      createErrorMsg(errmsg_, err, err2, "Unexpected fopen error");
+      return;
+    }
+
+    std::ostringstream ddname;
+    ddname << "NAMEDD";
+
+    __dyn_t dyn;
+    dyninit(&dyn);
+    dyn.__dsname = &(path_[0]);
+    dyn.__ddname = &(ddname.str()[0]);
+    dyn.__normdisp = __DISP_CATLG;
+    dyn.__lrecl = std::accumulate(layout_.begin(), layout_.end(), 0,
+                                  [](int n, LayoutItem& l) -> int { return n + l.maxLength; });
+    dyn.__keylength = layout_[0].maxLength;
+    dyn.__recorg = __KS;
+    t = VsamTrace::Begin();
+    int rc = dynalloc(&dyn);
+    VsamTrace::End(t, "dynalloc", opname_, path_, 0, false);
+    if (rc != 0) {
+      errmsg_ = "Failed to allocate dataset";
+      return;
+    }
+    t = VsamTrace::Begin();
+    stream_ = fopen(dataset.str().c_str(), "ab+,type=record");
+    VsamTrace::End(t, "fopen", opname_, path_, 0, false);
+    if (stream_ == NULL) {
+      createErrorMsg(errmsg_, errno, __errno2(), "Failed to open new dataset");
+      return;
+    }
+  }
+
+  if (!reused) {
+    fldata_t dinfo;
+    fldata(stream_, NULL, &dinfo);
+    keylen_ = dinfo.__vsamkeylen;
+    reclen_ = dinfo.__maxreclen;
+  }
+  if (keylen_ != layout_[0].maxLength) {
+    errmsg_ = "Incorrect key length";
+    CloseStream();
+    return;
+  }
+  if (!reused && VsamRegistry::Enabled()) {
+    VsamRegistry::Add(path_, omode_, keylen_, reclen_);
+    registered_ = true;
+  }
+  keyoff_ = 0;
+  for (int i = 0; i < key_i_; ++i)
+    keyoff_ += layout_[i].maxLength;
+  pos_ = std::make_shared<Position>(keylen_);
+  active_ = pos_;
+  // A stream taken over from the registry is wherever its last user left it.
+  if (reused)
+    owner_.reset();
+  else
+    owner_ = pos_;
+  lastrc_ = 0;
+}
+
+
+int VsamFile::CloseStream() {
+  int rc = 0;
+  if (!registered_ || !VsamRegistry::Release(path_, omode_, stream_))
+    rc = fclose(stream_);
+  registered_ = false;
+  stream_ = NULL;
+  return rc;
+}
+
+
+void VsamFile::Open(uv_work_t* req) {
+  VsamFile* obj = (VsamFile*)(req->data);
+  obj->TraceWork();
+  obj->OpenStream();
+}
+
+
+void VsamFile::Alloc(uv_work_t* req) {
+  VsamFile* obj = (VsamFile*)(req->data);
+  obj->TraceWork();
+  obj->OpenStream();
+}
+
+
+void VsamFile::OpenCallback(uv_work_t* req, int status) {
+  VsamFile* obj = (VsamFile*)(req->data);
+  delete req;
+
+  if (status == UV_ECANCELED)
+    return;
+
+  Napi::HandleScope scope(obj->env_);
+  if (obj->lastrc_ != 0) {
+    obj->cb_.Call(obj->env_.Global(), {obj->env_.Null(), Napi::String::New(obj->env_, obj->errmsg_)});
+  }
+  else {
+    obj->cb_.Call(obj->env_.Global(), {obj->Value(), obj->env_.Null()});
+  }
+  obj->Unref();
+}
+
+
+VsamFile::~VsamFile() {
+  if (stream_ != NULL)
+    CloseStream();
+  uv_mutex_destroy(&indexmutex_);
+}
+
+
+void VsamFile::Init(Napi::Env env, Napi::Object exports) {
+  // Prepare constructor template
+  Napi::HandleScope scope(env);
+
+  Napi::Function func = DefineClass(env, "VsamFile", {
+    InstanceMethod("read", &VsamFile::Read),
+    InstanceMethod("find", &VsamFile::FindEq),
+    InstanceMethod("findeq", &VsamFile::FindEq),
+    InstanceMethod("findge", &VsamFile::FindGe),
+    InstanceMethod("findfirst", &VsamFile::FindFirst),
+    InstanceMethod("findlast", &VsamFile::FindLast),
+    InstanceMethod("update", &VsamFile::Update),
+    InstanceMethod("write", &VsamFile::Write),
+    InstanceMethod("delete", &VsamFile::Delete),
+    InstanceMethod("close", &VsamFile::Close),
+    InstanceMethod("dealloc", &VsamFile::Dealloc),
+    InstanceMethod("cursor", &VsamFile::Cursor),
+    InstanceMethod("apply", &VsamFile::Apply),
+    InstanceMethod("updateByKey", &VsamFile::UpdateByKey),
+    InstanceMethod("deleteByKey", &VsamFile::DeleteByKey),
+    InstanceMethod("upsert", &VsamFile::Upsert),
+    InstanceMethod("aggregate", &VsamFile::Aggregate),
+    InstanceMethod("createIndex", &VsamFile::CreateIndex),
+    InstanceMethod("dropIndex", &VsamFile::DropIndex),
+    InstanceMethod("findBy", &VsamFile::FindBy),
+    InstanceMethod("snapshot", &VsamFile::Snapshot),
+    InstanceMethod("captureChanges", &VsamFile::CaptureChanges),
+    InstanceMethod("stopCapture", &VsamFile::StopCapture),
+    InstanceMethod("changes", &VsamFile::Changes),
+    InstanceMethod("has", &VsamFile::Has),
+    InstanceMethod("hasMany", &VsamFile::HasMany),
+    InstanceMethod("keys", &VsamFile::Keys),
+    InstanceMethod("buildKeyFilter", &VsamFile::BuildKeyFilter),
+    InstanceMethod("dropKeyFilter", &VsamFile::DropKeyFilter),
+    InstanceMethod("deleteRange", &VsamFile::DeleteRange)
+  });
+
+  constructor_ = Napi::Persistent(func);
+  constructor_.SuppressDestruct();
+
+  exports.Set("VsamFile", func);
+}
+
+
+Napi::Value VsamFile::Construct(const Napi::CallbackInfo& info, bool alloc, bool async) {
+  Napi::Env env = info.Env();
+
+  // The async variants take a trailing callback
+  int nargs = info.Length() - (async ? 1 : 0);
+  std::string path (static_cast<std::string>(info[0].As<Napi::String>()));
+  Napi::Object schema = info[1].ToObject();
+  std::string mode = nargs == 2 ? "ab+,type=record"
+                     : (static_cast<std::string>(info[2].As<Napi::String>()));
+  Napi::Array properties = schema.GetPropertyNames();
+  std::vector<LayoutItem> layout;
+  int key_i = 0; // for its data type - default to first field if no "key" found
+  for (int i = 0; i < properties.Length(); ++i) {
+    std::string name (static_cast<std::string>(Napi::String (env, properties.Get(i).ToString())));
+
+    Napi::Object item = schema.Get(properties.Get(i)).As<Napi::Object>();
+    if (item.IsEmpty()) {
+      Napi::Error::New(env, "JSON is incorrect.").ThrowAsJavaScriptException();
+      return env.Null();
+    }
+
+    Napi::Value length = item.Get(Napi::String::New(env,"maxLength"));
+    if (length.IsEmpty() || !length.IsNumber()) {
+      Napi::Error::New(env, "JSON is incorrect.").ThrowAsJavaScriptException();
+      return env.Null();
+    }
+
+    Napi::Value jtype = item.Get(Napi::String::New(env,"type"));
+    if (jtype.IsEmpty()) {
+      Napi::Error::New(env, "JSON \"type\" is empty.").ThrowAsJavaScriptException();
+      return env.Null();
+    }
+
+    std::string stype(static_cast<std::string>(jtype.As<Napi::String>()));
+    if (!strcmp(stype.c_str(),"string")) {
+      layout.push_back(LayoutItem(name, length.ToNumber().Int32Value(), LayoutItem::STRING));
+    } else if (!strcmp(stype.c_str(),"hexadecimal")) {
+      layout.push_back(LayoutItem(name, length.ToNumber().Int32Value(), LayoutItem::HEXADECIMAL));
+    } else {
+      Napi::Error::New(env, "JSON \"type\" must be \"string\" or \"hexadecimal\"").ThrowAsJavaScriptException();
+      return env.Null();
+    }
+
+    if (!strcmp(name.c_str(),"key")) {
+      key_i = i;
+    }
+  }
+
+  Napi::HandleScope scope(env);
+  Napi::Object obj = constructor_.New({
+    Napi::String::New(env, path),
+    Napi::Buffer<std::vector<LayoutItem>>::Copy(env, &layout, layout.size()),
+    Napi::Boolean::New(env, alloc),
+    Napi::Number::New(env, key_i),
+    Napi::String::New(env, mode),
+    Napi::Boolean::New(env, async)});
+
+  VsamFile* p = Napi::ObjectWrap<VsamFile>::Unwrap(obj);
+  if (async) {
+    // Keep the handle alive until OpenCallback hands it over
+    p->Ref();
+    p->cb_ = Napi::Persistent(info[info.Length()-1].As<Napi::Function>());
+    uv_work_t* request = new uv_work_t;
+    request->data = p;
+    p->TraceQueue(alloc ? "alloc" : "open", 0);
+    uv_queue_work(uv_default_loop(), request, alloc ? Alloc : Open, OpenCallback);
+    return env.Undefined();
+  }
+  if (p->lastrc_) {
+    Napi::Error::New(env, p->errmsg_.c_str()).ThrowAsJavaScriptException();
+    delete p;
+    return env.Null();
+  }
+  return obj;
+}
+
+
+Napi::Value VsamFile::AllocSync(const Napi::CallbackInfo& info) {
+  if (info.Length() != 2 || !info[0].IsString() || !info[1].IsObject()) {
+    Napi::Error::New(info.Env(), "Wrong arguments to allocSync(), must be: "\
+                          "VSAM dataset name, schema JSON object").ThrowAsJavaScriptException();
+    return info.Env().Null();
+  }
+  return Construct(info, true);
+}
+
+
+Napi::Value VsamFile::OpenSync(const Napi::CallbackInfo& info) {
+  if ((info.Length() < 2 || !info[0].IsString() || !info[1].IsObject())
+  ||  (info.Length() == 3 && !info[2].IsString())
+  ||  (info.Length() > 3)) {
+    Napi::Error::New(info.Env(), "Wrong arguments to openSync(), must be: "\
+                          "VSAM dataset name, schema JSON object, optional fopen() mode")
+                          .ThrowAsJavaScriptException();
+    return info.Env().Null();
+  }
+  return Construct(info, false);
+}
+
+
+Napi::Value VsamFile::AllocAsync(const Napi::CallbackInfo& info) {
+  if (info.Length() != 3 || !info[0].IsString() || !info[1].IsObject()
+  ||  !info[2].IsFunction()) {
+    Napi::Error::New(info.Env(), "Wrong arguments to alloc(), must be: "\
+                          "VSAM dataset name, schema JSON object, callback").ThrowAsJavaScriptException();
+    return info.Env().Null();
+  }
+  return Construct(info, true, true);
+}
+
+
+Napi::Value VsamFile::OpenAsync(const Napi::CallbackInfo& info) {
+  if ((info.Length() < 3 || !info[0].IsString() || !info[1].IsObject())
+  ||  (info.Length() == 4 && !info[2].IsString())
+  ||  (info.Length() > 4)
+  ||  !info[info.Length()-1].IsFunction()) {
+    Napi::Error::New(info.Env(), "Wrong arguments to open(), must be: "\
+                          "VSAM dataset name, schema JSON object, optional fopen() mode, callback")
+                          .ThrowAsJavaScriptException();
+    return info.Env().Null();
+  }
+  return Construct(info, false, true);
+}
+
+
+void VsamFile::ExistWork(uv_work_t* req) {
+  ExistRequest* r = (ExistRequest*)(req->data);
+  VsamTrace::End(r->queued, "queue", "exist", r->path, 0, false);
+  std::ostringstream dataset;
+  dataset << "//'" << r->path.c_str() << "'";
+  uint64_t t = VsamTrace::Begin();
+  r->exists = isDatasetExist(dataset.str().c_str());
+  VsamTrace::End(t, "fopen", "exist", r->path, 0, false);
+}
+
+
+void VsamFile::ExistCallback(uv_work_t* req, int status) {
+  ExistRequest* r = (ExistRequest*)(req->data);
+  delete req;
+
+  if (status != UV_ECANCELED) {
+    Napi::HandleScope scope(r->env);
+    r->cb.Call(r->env.Global(), {Napi::Boolean::New(r->env, r->exists)});
+  }
+  delete r;
+}
+
+
+Napi::Value VsamFile::Exist(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  if (info.Length() != 1 && info.Length() != 2) {
+    // Throw an Error that is passed back to JavaScript
+    Napi::Error::New(env, "Wrong number of arguments.").ThrowAsJavaScriptException();
+    return Napi::Boolean::New(env, false);
+  }
+
+  if (!info[0].IsString() || (info.Length() == 2 && !info[1].IsFunction())) {
+    Napi::TypeError::New(env, "Wrong arguments").ThrowAsJavaScriptException();
+    return Napi::Boolean::New(env, false);
+  }
+
+  std::string path (static_cast<std::string>(info[0].As<Napi::String>()));
+  if (info.Length() == 2) {
+    ExistRequest* r = new ExistRequest(env, path);
+    r->cb = Napi::Persistent(info[1].As<Napi::Function>());
+    uv_work_t* request = new uv_work_t;
+    request->data = r;
+    r->queued = VsamTrace::Begin();
+    uv_queue_work(uv_default_loop(), request, ExistWork, ExistCallback);
+    return env.Undefined();
+  }
+
+  std::ostringstream dataset;
+  dataset << "//'" << path.c_str() << "'";
+  uint64_t t = VsamTrace::Begin();
+  bool exists = isDatasetExist(dataset.str().c_str());
+  VsamTrace::End(t, "fopen", "exist", path, 0, false);
+  return Napi::Boolean::New(env, exists);
+}
+
+
+void VsamFile::Close(const Napi::CallbackInfo& args) {
+  if (stream_ == NULL) {
+    Napi::Error::New(env_, "VSAM file is not open.").ThrowAsJavaScriptException();
+    return;
+  }
+
+  if (CloseStream()) {
+    Napi::Error::New(env_, "Error closing file.").ThrowAsJavaScriptException();
+    return;
+  }
+}
+
+
+void VsamFile::Delete(const Napi::CallbackInfo& info) {
+  if (info.Length() < 1) {
+    // Throw an Error that is passed back to JavaScript
+    Napi::Error::New(env_, "Wrong number of arguments.").ThrowAsJavaScriptException();
+    return;
+  }
+
+  if (!info[0].IsFunction()) {
+    Napi::TypeError::New(env_, "Wrong arguments.").ThrowAsJavaScriptException();
+    return;
+  }
+
+  uv_work_t* request = new uv_work_t;
+  request->data = this;
+  cb_ = Napi::Persistent(info[0].As<Napi::Function>());
+  cur_ = active_;
+  TraceQueue("delete", keylen_);
+  uv_queue_work(uv_default_loop(), request, Delete, DeleteCallback);
+}
+
+
+void VsamFile::Write(const Napi::CallbackInfo& info) {
+  if (info.Length() < 2) {
+    // Throw an Error that is passed back to JavaScript
+    Napi::Error::New(env_, "Wrong number of arguments.").ThrowAsJavaScriptException();
+    return;
+  }
+
+  if (!info[1].IsFunction()) {
+    Napi::TypeError::New(env_, "Wrong arguments.").ThrowAsJavaScriptException();
+    return;
+  }
+
+  Napi::Object record = info[0].ToObject();
+  if (buf_) {
+    free(buf_);
+  }
+  buf_ = malloc(reclen_); //TODO: error
+  memset(buf_,0,reclen_);
+  if (!EncodeRecord(record, (char*)buf_, NULL))
+    return;
+
+  uv_work_t* request = new uv_work_t;
+  request->data = this;
+  cb_ = Napi::Persistent(info[1].As<Napi::Function>());
+  cur_ = active_;
+  TraceQueue("write", keylen_);
+  uv_queue_work(uv_default_loop(), request, Write, WriteCallback);
+}
+
+
+void VsamFile::Update(const Napi::CallbackInfo& info) {
+  if (info.Length() < 2) {
+    // Throw an Error that is passed back to JavaScript
+    Napi::Error::New(env_, "Wrong number of arguments.").ThrowAsJavaScriptException();
+    return;
+  }
+
+  if (!info[1].IsFunction()) {
+    Napi::TypeError::New(env_, "Wrong arguments.").ThrowAsJavaScriptException();
+    return;
+  }
+
+  Napi::Object record = info[0].ToObject();
+  if (buf_) {
+    free(buf_);
+  }
+  buf_ = malloc(reclen_); //TODO: error
+  memset(buf_,0,reclen_);
+  if (!EncodeRecord(record, (char*)buf_, NULL))
+    return;
+
+  uv_work_t* request = new uv_work_t;
+  request->data = this;
+  cb_ = Napi::Persistent(info[1].As<Napi::Function>());
+  cur_ = active_;
+  TraceQueue("update", keylen_);
+  uv_queue_work(uv_default_loop(), request, Update, UpdateCallback);
+}
+
+bool VsamFile::EncodeField(const LayoutItem& item, Napi::Value value, char* buf) {
+  memset(buf, 0, item.maxLength);
+  if (item.type != LayoutItem::STRING && item.type != LayoutItem::HEXADECIMAL) {
+    Napi::TypeError::New(env_, "Unexpected JSON data type").ThrowAsJavaScriptException();
+    return false;
+  }
+  std::string str = static_cast<std::string>(Napi::String (env_, value.ToString()));
+  if (item.type == LayoutItem::STRING) {
+    memcpy(buf, str.c_str(), std::min<size_t>(str.length(), item.maxLength));
+  } else {
+    char tmp[item.maxLength + str.length()/2 + 1];
+    hexstrToBuffer(tmp, sizeof(tmp), str.c_str());
+    memcpy(buf, tmp, item.maxLength);
+  }
+  return true;
+}
+
+
+bool VsamFile::EncodeRecord(Napi::Object record, char* buf, std::vector<bool>* mask) {
+  // With a mask, fields missing from the record are left zero and unmarked
+  memset(buf, 0, reclen_);
+  if (mask)
+    mask->assign(layout_.size(), false);
+  for (size_t n = 0; n < layout_.size(); ++n) {
+    LayoutItem& item = layout_[n];
+    Napi::Value field = record.Get(&(item.name[0]));
+    if (mask && field.IsUndefined()) {
+      buf += item.maxLength;
+      continue;
+    }
+    if (!EncodeField(item, field, buf))
+      return false;
+    if (mask)
+      (*mask)[n] = true;
+    buf += item.maxLength;
+  }
+  return true;
+}
+
+
+bool VsamFile::EncodeKey(Napi::Value value, char* buf, size_t* len) {
+  return EncodeKey(env_, layout_[key_i_].type, keylen_, value, buf, len);
+}
+
+
+bool VsamFile::EncodeKey(Napi::Env env, LayoutItem::DataType type, unsigned keylen,
+                         Napi::Value value, char* buf, size_t* len) {
+  // len, if given, receives the number of key bytes actually supplied
+  memset(buf, 0, keylen);
+  size_t n;
+  if (value.IsString()) {
+    std::string key = static_cast<std::string>(value.As<Napi::String>());
+    if (type == LayoutItem::HEXADECIMAL) {
+      char tmp[keylen + key.length()/2 + 1];
+      hexstrToBuffer(tmp, sizeof(tmp), key.c_str());
+      n = std::min<size_t>(key.length()/2, keylen);
+      memcpy(buf, tmp, keylen);
+    } else {
+      n = std::min<size_t>(key.length(), keylen);
+      memcpy(buf, key.c_str(), n);
+    }
+  } else if (value.IsBuffer()) {
+    Napi::Buffer<char> b = value.As<Napi::Buffer<char>>();
+    n = std::min<size_t>(b.Length(), keylen);
+    memcpy(buf, b.Data(), n);
+  } else {
+    Napi::TypeError::New(env, "Key must be either a string or a Buffer object.").ThrowAsJavaScriptException();
+    return false;
+  }
+  if (len)
+    *len = n;
+  return true;
+}
+
+
+bool VsamFile::ParseOp(Napi::Value value, KeyedOp& op) {
+  if (!value.IsObject()) {
+    Napi::TypeError::New(env_, "Each operation must be an object.").ThrowAsJavaScriptException();
+    return false;
+  }
+  Napi::Object o = value.As<Napi::Object>();
+  std::string type = static_cast<std::string>(o.Get("op").ToString());
+  if (type == "write") {
+    op.type = KeyedOp::WRITE;
+  } else if (type == "update") {
+    op.type = KeyedOp::UPDATE;
+  } else if (type == "delete") {
+    op.type = KeyedOp::DELETE;
+  } else if (type == "upsert") {
+    op.type = KeyedOp::UPSERT;
+  } else {
+    Napi::TypeError::New(env_, "Operation \"op\" must be \"write\", \"update\", \"delete\" or \"upsert\".")
+        .ThrowAsJavaScriptException();
+    return false;
+  }
+
+  return EncodeOp(op, o.Get("key"), o.Get("record"));
+}
+
+
+bool VsamFile::EncodeOp(KeyedOp& op, Napi::Value key, Napi::Value record) {
+  if (op.type != KeyedOp::DELETE) {
+    if (!record.IsObject()) {
+      Napi::TypeError::New(env_, "Record must be an object.").ThrowAsJavaScriptException();
+      return false;
+    }
+    op.record.resize(reclen_);
+    if (!EncodeRecord(record.As<Napi::Object>(), &op.record[0],
+                      op.type == KeyedOp::UPDATE ? &op.mask : NULL))
+      return false;
+  }
+
+  op.key.resize(keylen_);
+  if (!key.IsUndefined()) {
+    if (!EncodeKey(key, &op.key[0]))
+      return false;
+  } else if (op.type == KeyedOp::DELETE || (op.type == KeyedOp::UPDATE && !op.mask[key_i_])) {
+    Napi::TypeError::New(env_, "Operation has no key.").ThrowAsJavaScriptException();
+    return false;
+  } else {
+    memcpy(&op.key[0], &op.record[keyoff_], keylen_);
+  }
+  if (op.type == KeyedOp::WRITE || op.type == KeyedOp::UPSERT)
+    memcpy(&op.record[keyoff_], &op.key[0], keylen_);
+  return true;
+}
+
+
+void VsamFile::MutateByKey(const Napi::CallbackInfo& info, int type) {
+  // updateByKey(key, patch, cb), deleteByKey(key, cb), upsert(record, cb)
+  size_t nargs = type == KeyedOp::UPDATE ? 3 : 2;
+  if (info.Length() < nargs) {
+    // Throw an Error that is passed back to JavaScript
+    Napi::Error::New(env_, "Wrong number of arguments.").ThrowAsJavaScriptException();
+    return;
+  }
+
+  if (!info[nargs-1].IsFunction()) {
+    Napi::TypeError::New(env_, "Wrong arguments.").ThrowAsJavaScriptException();
+    return;
+  }
+
+  std::vector<KeyedOp> parsed(1);
+  parsed[0].type = (KeyedOp::Type)type;
+  const char* opname = type == KeyedOp::UPDATE ? "updateByKey"
+                       : type == KeyedOp::DELETE ? "deleteByKey" : "upsert";
+  bool ok;
+  if (type == KeyedOp::UPSERT)
+    ok = EncodeOp(parsed[0], env_.Undefined(), info[0]);
+  else
+    ok = EncodeOp(parsed[0], info[0], type == KeyedOp::UPDATE ? info[1] : env_.Undefined());
+  if (!ok)
+    return;
+  ops_.swap(parsed);
+
+  uv_work_t* request = new uv_work_t;
+  request->data = this;
+  cb_ = Napi::Persistent(info[nargs-1].As<Napi::Function>());
+  TraceQueue(opname, keylen_);
+  uv_queue_work(uv_default_loop(), request, MutateByKey, MutateByKeyCallback);
+}
+
+
+void VsamFile::UpdateByKey(const Napi::CallbackInfo& info) {
+  MutateByKey(info, KeyedOp::UPDATE);
+}
+
+void VsamFile::DeleteByKey(const Napi::CallbackInfo& info) {
+  MutateByKey(info, KeyedOp::DELETE);
+}
+
+void VsamFile::Upsert(const Napi::CallbackInfo& info) {
+  MutateByKey(info, KeyedOp::UPSERT);
+}
+
+
+void VsamFile::Apply(const Napi::CallbackInfo& info) {
+  if (info.Length() < 2) {
+    // Throw an Error that is passed back to JavaScript
+    Napi::Error::New(env_, "Wrong number of arguments.").ThrowAsJavaScriptException();
+    return;
+  }
+
+  int callbackArg = info.Length() == 2 ? 1 : 2;
+  if (!info[0].IsArray() || (callbackArg == 2 && !info[1].IsObject())
+  ||  !info[callbackArg].IsFunction()) {
+    Napi::TypeError::New(env_, "Wrong arguments to apply(), must be: "\
+                               "array of operations, optional options object, callback")
+                               .ThrowAsJavaScriptException();
+    return;
+  }
+
+  Napi::Array ops = info[0].As<Napi::Array>();
+  std::vector<KeyedOp> parsed(ops.Length());
+  for (uint32_t i = 0; i < ops.Length(); ++i) {
+    if (!ParseOp(ops.Get(i), parsed[i]))
+      return;
+  }
+  atomic_ = callbackArg == 2 &&
+            info[1].As<Napi::Object>().Get("atomic").ToBoolean().Value();
+  ops_.swap(parsed);
+
+  uv_work_t* request = new uv_work_t;
+  request->data = this;
+  cb_ = Napi::Persistent(info[callbackArg].As<Napi::Function>());
+  TraceQueue("apply", keylen_);
+  uv_queue_work(uv_default_loop(), request, Apply, ApplyCallback);
+}
+
+
+int VsamFile::FieldIndex(const std::string& name) {
+  for (size_t n = 0; n < layout_.size(); ++n) {
+    if (!strcmp(&(layout_[n].name[0]), name.c_str()))
+      return n;
+  }
+  return -1;
+}
+
+
+unsigned VsamFile::FieldOffset(int field) {
+  unsigned off = 0;
+  for (int n = 0; n < field; ++n)
+    off += layout_[n].maxLength;
+  return off;
+}
+
+
+bool VsamFile::ParseRange(Napi::Value value, KeyRange& range) {
+  return ParseRange(env_, layout_[key_i_].type, keylen_, value, range);
+}
+
+
+bool VsamFile::ParseRange(Napi::Env env, LayoutItem::DataType type, unsigned keylen,
+                          Napi::Value value, KeyRange& range) {
+  // undefined for the whole dataset, { start, end } or { prefix }
+  range.start.assign(keylen, 0);
+  range.end.assign(keylen, 0);
+  if (value.IsUndefined())
+    return true;
+  if (!value.IsObject()) {
+    Napi::TypeError::New(env, "Range must be an object.").ThrowAsJavaScriptException();
+    return false;
+  }
+
+  Napi::Object o = value.As<Napi::Object>();
+  Napi::Value prefix = o.Get("prefix");
+  if (!prefix.IsUndefined()) {
+    if (type == LayoutItem::HEXADECIMAL && prefix.IsString() &&
+        static_cast<std::string>(prefix.As<Napi::String>()).length() % 2) {
+      Napi::TypeError::New(env, "Range prefix must be a whole number of hexadecimal bytes.")
+          .ThrowAsJavaScriptException();
+      return false;
+    }
+    if (!EncodeKey(env, type, keylen, prefix, &range.start[0], &range.prefixlen))
+      return false;
+    if (range.prefixlen == 0) {
+      Napi::TypeError::New(env, "Range prefix must not be empty.").ThrowAsJavaScriptException();
+      return false;
+    }
+    range.from_first = false;
+    return true;
+  }
+  Napi::Value start = o.Get("start");
+  if (!start.IsUndefined()) {
+    if (!EncodeKey(env, type, keylen, start, &range.start[0]))
+      return false;
+    range.from_first = false;
+  }
+  Napi::Value end = o.Get("end");
+  if (!end.IsUndefined()) {
+    if (!EncodeKey(env, type, keylen, end, &range.end[0]))
+      return false;
+    range.to_last = false;
+  }
+  return true;
+}
+
+
+void VsamFile::Aggregate(const Napi::CallbackInfo& info) {
+  if (info.Length() < 2) {
+    // Throw an Error that is passed back to JavaScript
+    Napi::Error::New(env_, "Wrong number of arguments.").ThrowAsJavaScriptException();
+    return;
+  }
+
+  if (!info[0].IsObject() || !info[1].IsFunction()) {
+    Napi::TypeError::New(env_, "Wrong arguments.").ThrowAsJavaScriptException();
+    return;
+  }
+
+  Napi::Object spec = info[0].As<Napi::Object>();
+  Aggregation agg;
+  if (!ParseRange(spec.Get("range"), agg.range))
+    return;
+
+  agg.groupBy = -1;
+  Napi::Value groupBy = spec.Get("groupBy");
+  if (!groupBy.IsUndefined()) {
+    std::string name = static_cast<std::string>(groupBy.ToString());
+    agg.groupBy = FieldIndex(name);
+    if (agg.groupBy < 0) {
+      Napi::Error::New(env_, "groupBy: no field named " + name).ThrowAsJavaScriptException();
       return;
     }
   }
 
-  fldata_t dinfo;
-  fldata(stream_, NULL, &dinfo);
-  keylen_ = dinfo.__vsamkeylen;
-  reclen_ = dinfo.__maxreclen;
-  if (keylen_ != layout_[0].maxLength) {
-    errmsg_ = "Incorrect key length";
-    fclose(stream_);
-    stream_ = NULL;
+  Napi::Value metrics = spec.Get("metrics");
+  if (metrics.IsUndefined()) {
+    Aggregation::Metric count = { Aggregation::Metric::COUNT, -1, "count" };
+    agg.metrics.push_back(count);
+  } else if (!metrics.IsArray()) {
+    Napi::TypeError::New(env_, "metrics must be an array.").ThrowAsJavaScriptException();
     return;
   }
-  lastrc_ = 0;
+  else {
+    Napi::Array list = metrics.As<Napi::Array>();
+    for (uint32_t i = 0; i < list.Length(); ++i) {
+      // "count", "sum(field)", "min(field)" or "max(field)"
+      Aggregation::Metric metric;
+      metric.name = static_cast<std::string>(list.Get(i).ToString());
+      metric.kind = Aggregation::Metric::COUNT;
+      metric.field = -1;
+      bool known = metric.name == "count";
+      size_t paren = metric.name.find('(');
+      if (!known && paren != std::string::npos && metric.name.back() == ')') {
+        std::string fn = metric.name.substr(0, paren);
+        known = true;
+        if (fn == "sum") {
+          metric.kind = Aggregation::Metric::SUM;
+        } else if (fn == "min") {
+          metric.kind = Aggregation::Metric::MIN;
+        } else if (fn == "max") {
+          metric.kind = Aggregation::Metric::MAX;
+        } else {
+          known = false;
+        }
+        metric.field = FieldIndex(metric.name.substr(paren+1, metric.name.length()-paren-2));
+        known = known && metric.field >= 0;
+      }
+      if (!known) {
+        Napi::Error::New(env_, "Unknown metric " + metric.name).ThrowAsJavaScriptException();
+        return;
+      }
+      agg.metrics.push_back(metric);
+    }
+  }
+
+  agg_ = agg;
+  uv_work_t* request = new uv_work_t;
+  request->data = this;
+  cb_ = Napi::Persistent(info[1].As<Napi::Function>());
+  TraceQueue("aggregate", keylen_);
+  uv_queue_work(uv_default_loop(), request, Aggregate, AggregateCallback);
 }
 
 
-VsamFile::~VsamFile() {
-  if (stream_ != NULL)
-    fclose(stream_);
-}
+void VsamFile::CreateIndex(const Napi::CallbackInfo& info) {
+  if (info.Length() < 2) {
+    // Throw an Error that is passed back to JavaScript
+    Napi::Error::New(env_, "Wrong number of arguments.").ThrowAsJavaScriptException();
+    return;
+  }
 
+  int callbackArg = info.Length() == 2 ? 1 : 2;
+  if (!info[0].IsString() || (callbackArg == 2 && !info[1].IsObject())
+  ||  !info[callbackArg].IsFunction()) {
+    Napi::TypeError::New(env_, "Wrong arguments to createIndex(), must be: "\
+                               "field name, optional options object, callback")
+                               .ThrowAsJavaScriptException();
+    return;
+  }
 
-void VsamFile::Init(Napi::Env env, Napi::Object exports) {
-  // Prepare constructor template
-  Napi::HandleScope scope(env);
+  std::string name = static_cast<std::string>(info[0].As<Napi::String>());
+  int field = FieldIndex(name);
+  if (field < 0 || field == key_i_) {
+    Napi::Error::New(env_, "createIndex: no non-key field named " + name).ThrowAsJavaScriptException();
+    return;
+  }
+  bool unique = callbackArg == 2 &&
+                info[1].As<Napi::Object>().Get("unique").ToBoolean().Value();
+  building_.reset(new VsamIndex(name, FieldOffset(field), layout_[field].maxLength,
+                                keyoff_, keylen_, unique));
 
-  Napi::Function func = DefineClass(env, "VsamFile", {
-    InstanceMethod("read", &VsamFile::Read),
-    InstanceMethod("find", &VsamFile::FindEq),
-    InstanceMethod("findeq", &VsamFile::FindEq),
-    InstanceMethod("findge", &VsamFile::FindGe),
-    InstanceMethod("findfirst", &VsamFile::FindFirst),
-    InstanceMethod("findlast", &VsamFile::FindLast),
-    InstanceMethod("update", &VsamFile::Update),
-    InstanceMethod("write", &VsamFile::Write),
-    InstanceMethod("delete", &VsamFile::Delete),
-    InstanceMethod("close", &VsamFile::Close),
-    InstanceMethod("dealloc", &VsamFile::Dealloc)
-  });
+  uv_work_t* request = new uv_work_t;
+  request->data = this;
+  cb_ = Napi::Persistent(info[callbackArg].As<Napi::Function>());
+  TraceQueue("createIndex", keylen_);
+  uv_queue_work(uv_default_loop(), request, CreateIndex, CreateIndexCallback);
+}
 
-  constructor_ = Napi::Persistent(func);
-  constructor_.SuppressDestruct();
 
-  exports.Set("VsamFile", func);
+void VsamFile::DropIndex(const Napi::CallbackInfo& info) {
+  if (info.Length() != 1 || !info[0].IsString()) {
+    Napi::TypeError::New(env_, "Wrong arguments.").ThrowAsJavaScriptException();
+    return;
+  }
+
+  std::string name = static_cast<std::string>(info[0].As<Napi::String>());
+  uv_mutex_lock(&indexmutex_);
+  for (auto i = indexes_.begin(); i != indexes_.end(); ++i) {
+    if (i->Name() == name) {
+      indexes_.erase(i);
+      break;
+    }
+  }
+  uv_mutex_unlock(&indexmutex_);
 }
 
 
-Napi::Value VsamFile::Construct(const Napi::CallbackInfo& info, bool alloc) {
-  Napi::Env env = info.Env();
+void VsamFile::FindBy(const Napi::CallbackInfo& info) {
+  if (info.Length() < 3) {
+    // Throw an Error that is passed back to JavaScript
+    Napi::Error::New(env_, "Wrong number of arguments.").ThrowAsJavaScriptException();
+    return;
+  }
 
-  std::string path (static_cast<std::string>(info[0].As<Napi::String>()));
-  Napi::Object schema = info[1].ToObject();
-  std::string mode = info.Length() == 2 ? "ab+,type=record"
-                     : (static_cast<std::string>(info[2].As<Napi::String>()));
-  Napi::Array properties = schema.GetPropertyNames();
-  std::vector<LayoutItem> layout;
-  int key_i = 0; // for its data type - default to first field if no "key" found
-  for (int i = 0; i < properties.Length(); ++i) {
-    std::string name (static_cast<std::string>(Napi::String (env, properties.Get(i).ToString())));
+  if (!info[0].IsString() || !info[2].IsFunction()) {
+    Napi::TypeError::New(env_, "Wrong arguments.").ThrowAsJavaScriptException();
+    return;
+  }
 
-    Napi::Object item = schema.Get(properties.Get(i)).As<Napi::Object>();
-    if (item.IsEmpty()) {
-      Napi::Error::New(env, "JSON is incorrect.").ThrowAsJavaScriptException();
-      return env.Null();
-    }
+  std::string name = static_cast<std::string>(info[0].As<Napi::String>());
+  size_t index = 0;
+  while (index < indexes_.size() && indexes_[index].Name() != name)
+    ++index;
+  if (index == indexes_.size()) {
+    Napi::Error::New(env_, "findBy: no index on field " + name).ThrowAsJavaScriptException();
+    return;
+  }
+  LayoutItem& item = layout_[FieldIndex(name)];
+  char value[item.maxLength];
+  if (!EncodeField(item, info[1], value))
+    return;
 
-    Napi::Value length = item.Get(Napi::String::New(env,"maxLength"));
-    if (length.IsEmpty() || !length.IsNumber()) {
-      Napi::Error::New(env, "JSON is incorrect.").ThrowAsJavaScriptException();
-      return env.Null();
-    }
+  uv_work_t* request = new uv_work_t;
+  request->data = this;
+  cb_ = Napi::Persistent(info[2].As<Napi::Function>());
+  findname_ = name;
+  findvalue_.assign(value, item.maxLength);
+  cur_ = active_;
+  TraceQueue("findBy", item.maxLength);
+  uv_queue_work(uv_default_loop(), request, FindBy, ReadCallback);
+}
 
-    Napi::Value jtype = item.Get(Napi::String::New(env,"type"));
-    if (jtype.IsEmpty()) {
-      Napi::Error::New(env, "JSON \"type\" is empty.").ThrowAsJavaScriptException();
-      return env.Null();
-    }
 
-    std::string stype(static_cast<std::string>(jtype.As<Napi::String>()));
-    if (!strcmp(stype.c_str(),"string")) {
-      layout.push_back(LayoutItem(name, length.ToNumber().Int32Value(), LayoutItem::STRING));
-    } else if (!strcmp(stype.c_str(),"hexadecimal")) {
-      layout.push_back(LayoutItem(name, length.ToNumber().Int32Value(), LayoutItem::HEXADECIMAL));
-    } else {
-      Napi::Error::New(env, "JSON \"type\" must be \"string\" or \"hexadecimal\"").ThrowAsJavaScriptException();
-      return env.Null();
-    }
+void VsamFile::Snapshot(const Napi::CallbackInfo& info) {
+  if (info.Length() < 2) {
+    // Throw an Error that is passed back to JavaScript
+    Napi::Error::New(env_, "Wrong number of arguments.").ThrowAsJavaScriptException();
+    return;
+  }
 
-    if (!strcmp(name.c_str(),"key")) {
-      key_i = i;
-    }
+  if (!info[0].IsString() || !info[1].IsFunction()) {
+    Napi::TypeError::New(env_, "Wrong arguments.").ThrowAsJavaScriptException();
+    return;
   }
 
-  Napi::HandleScope scope(env);
-  Napi::Object obj = constructor_.New({
-    Napi::String::New(env, path),
-    Napi::Buffer<std::vector<LayoutItem>>::Copy(env, &layout, layout.size()),
-    Napi::Boolean::New(env, alloc),
-    Napi::Number::New(env, key_i),
-    Napi::String::New(env, mode)});
+  snappath_ = static_cast<std::string>(info[0].As<Napi::String>());
+  uv_work_t* request = new uv_work_t;
+  request->data = this;
+  cb_ = Napi::Persistent(info[1].As<Napi::Function>());
+  TraceQueue("snapshot", keylen_);
+  uv_queue_work(uv_default_loop(), request, Snapshot, SnapshotCallback);
+}
 
-  VsamFile* p = Napi::ObjectWrap<VsamFile>::Unwrap(obj);
-  if (p->lastrc_) {
-    Napi::Error::New(env, p->errmsg_.c_str()).ThrowAsJavaScriptException();
-    delete p;
-    return env.Null();
+
+void VsamFile::CaptureChanges(const Napi::CallbackInfo& info) {
+  if (info.Length() > 1 || (info.Length() == 1 && !info[0].IsNumber())) {
+    Napi::TypeError::New(env_, "Wrong arguments.").ThrowAsJavaScriptException();
+    return;
   }
-  return obj;
+  if (stream_ == NULL) {
+    Napi::Error::New(env_, "VSAM file is not open.").ThrowAsJavaScriptException();
+    return;
+  }
+  int64_t capacity = info.Length() == 1 ? info[0].As<Napi::Number>().Int64Value() : 0;
+  if (info.Length() == 1 && (capacity < 1 || capacity > (int64_t)VsamChangeLog::kMaxCapacity)) {
+    std::ostringstream msg;
+    msg << "Change log capacity must be from 1 to " << VsamChangeLog::kMaxCapacity << ".";
+    Napi::Error::New(env_, msg.str()).ThrowAsJavaScriptException();
+    return;
+  }
+  std::string errmsg;
+  if (!VsamChangeLog::Enable(path_, reclen_, (size_t)capacity, errmsg))
+    Napi::Error::New(env_, errmsg).ThrowAsJavaScriptException();
 }
 
 
-Napi::Value VsamFile::AllocSync(const Napi::CallbackInfo& info) {
-  if (info.Length() != 2 || !info[0].IsString() || !info[1].IsObject()) {
-    Napi::Error::New(info.Env(), "Wrong arguments to allocSync(), must be: "\
-                          "VSAM dataset name, schema JSON object").ThrowAsJavaScriptException();
-    return info.Env().Null();
+void VsamFile::StopCapture(const Napi::CallbackInfo& info) {
+  if (info.Length() != 0) {
+    Napi::TypeError::New(env_, "Wrong arguments.").ThrowAsJavaScriptException();
+    return;
   }
-  return Construct(info, true);
+  if (!VsamChangeLog::Disable(path_))
+    Napi::Error::New(env_, "Change capture is not enabled for this dataset.")
+        .ThrowAsJavaScriptException();
 }
 
 
-Napi::Value VsamFile::OpenSync(const Napi::CallbackInfo& info) {
-  if ((info.Length() < 2 || !info[0].IsString() || !info[1].IsObject())
-  ||  (info.Length() == 3 && !info[2].IsString())
-  ||  (info.Length() > 3)) {
-    Napi::Error::New(info.Env(), "Wrong arguments to openSync(), must be: "\
-                          "VSAM dataset name, schema JSON object, optional fopen() mode")
-                          .ThrowAsJavaScriptException();
-    return info.Env().Null();
+Napi::Value VsamFile::Changes(const Napi::CallbackInfo& info) {
+  if (info.Length() > 1 || (info.Length() == 1 && !info[0].IsObject())) {
+    Napi::TypeError::New(env_, "Wrong arguments.").ThrowAsJavaScriptException();
+    return env_.Null();
   }
-  return Construct(info, false);
+  double from = 0;
+  if (info.Length() == 1) {
+    Napi::Value seq = info[0].As<Napi::Object>().Get("fromSeq");
+    if (!seq.IsUndefined() && (!seq.IsNumber() || seq.As<Napi::Number>().DoubleValue() < 1)) {
+      Napi::TypeError::New(env_, "fromSeq must be a positive number.").ThrowAsJavaScriptException();
+      return env_.Null();
+    }
+    if (!seq.IsUndefined())
+      from = seq.As<Napi::Number>().DoubleValue();
+  }
+  return VsamChangeFeed::New(env_, Value(), (uint64_t)from);
 }
 
 
-Napi::Boolean VsamFile::Exist(const Napi::CallbackInfo& info) {
-  Napi::Env env = info.Env();
-  if (info.Length() != 1) {
+void VsamFile::Has(const Napi::CallbackInfo& info) {
+  if (info.Length() < 2) {
     // Throw an Error that is passed back to JavaScript
-    Napi::Error::New(env, "Wrong number of arguments.").ThrowAsJavaScriptException();
-    return Napi::Boolean::New(env, false);
+    Napi::Error::New(env_, "Wrong number of arguments.").ThrowAsJavaScriptException();
+    return;
   }
 
-  if (!info[0].IsString()) {
-    Napi::TypeError::New(env, "Wrong arguments").ThrowAsJavaScriptException();
-    return Napi::Boolean::New(env, false);
+  if (!info[1].IsFunction()) {
+    Napi::TypeError::New(env_, "Wrong arguments.").ThrowAsJavaScriptException();
+    return;
   }
 
-  std::string path (static_cast<std::string>(info[0].As<Napi::String>()));
-  std::ostringstream dataset;
-  dataset << "//'" << path.c_str() << "'";
-  return Napi::Boolean::New(env, isDatasetExist(dataset.str().c_str()));
+  std::vector<char> probes(keylen_);
+  if (!EncodeKey(info[0], &probes[0]))
+    return;
+
+  probes_.swap(probes);
+  many_ = false;
+  uv_work_t* request = new uv_work_t;
+  request->data = this;
+  cb_ = Napi::Persistent(info[1].As<Napi::Function>());
+  TraceQueue("has", keylen_);
+  uv_queue_work(uv_default_loop(), request, Has, HasCallback);
 }
 
 
-void VsamFile::Close(const Napi::CallbackInfo& args) {
-  if (stream_ == NULL) {
-    Napi::Error::New(env_, "VSAM file is not open.").ThrowAsJavaScriptException();
+void VsamFile::HasMany(const Napi::CallbackInfo& info) {
+  if (info.Length() < 2) {
+    // Throw an Error that is passed back to JavaScript
+    Napi::Error::New(env_, "Wrong number of arguments.").ThrowAsJavaScriptException();
     return;
   }
 
-  if (fclose(stream_)) {
-    Napi::Error::New(env_, "Error closing file.").ThrowAsJavaScriptException();
+  if (!info[0].IsArray() || !info[1].IsFunction()) {
+    Napi::TypeError::New(env_, "Wrong arguments.").ThrowAsJavaScriptException();
     return;
   }
-  stream_ = NULL;
+
+  Napi::Array keys = info[0].As<Napi::Array>();
+  if (keys.Length() == 0) {
+    Napi::Error::New(env_, "hasMany: no keys given.").ThrowAsJavaScriptException();
+    return;
+  }
+  std::vector<char> probes(keys.Length() * keylen_);
+  for (uint32_t i = 0; i < keys.Length(); ++i) {
+    if (!EncodeKey(keys.Get(i), &probes[i * keylen_]))
+      return;
+  }
+
+  probes_.swap(probes);
+  many_ = true;
+  uv_work_t* request = new uv_work_t;
+  request->data = this;
+  cb_ = Napi::Persistent(info[1].As<Napi::Function>());
+  TraceQueue("hasMany", keylen_);
+  uv_queue_work(uv_default_loop(), request, Has, HasCallback);
 }
 
 
-void VsamFile::Delete(const Napi::CallbackInfo& info) {
+void VsamFile::Keys(const Napi::CallbackInfo& info) {
   if (info.Length() < 1) {
     // Throw an Error that is passed back to JavaScript
     Napi::Error::New(env_, "Wrong number of arguments.").ThrowAsJavaScriptException();
     return;
   }
 
-  if (!info[0].IsFunction()) {
-    Napi::TypeError::New(env_, "Wrong arguments.").ThrowAsJavaScriptException();
+  int callbackArg = info.Length() == 1 ? 0 : 1;
+  if (!info[callbackArg].IsFunction()) {
+    Napi::TypeError::New(env_, "Wrong arguments to keys(), must be: "\
+                               "optional range, callback")
+                               .ThrowAsJavaScriptException();
     return;
   }
 
+  KeyRange range;
+  if (!ParseRange(callbackArg == 1 ? info[0] : env_.Undefined(), range))
+    return;
+
+  range_ = range;
   uv_work_t* request = new uv_work_t;
   request->data = this;
-  cb_ = Napi::Persistent(info[0].As<Napi::Function>());
-  uv_queue_work(uv_default_loop(), request, Delete, DeleteCallback);
+  cb_ = Napi::Persistent(info[callbackArg].As<Napi::Function>());
+  TraceQueue("keys", keylen_);
+  uv_queue_work(uv_default_loop(), request, Keys, KeysCallback);
 }
 
 
-void VsamFile::Write(const Napi::CallbackInfo& info) {
-  if (info.Length() < 2) {
+void VsamFile::BuildKeyFilter(const Napi::CallbackInfo& info) {
+  if (info.Length() < 1) {
     // Throw an Error that is passed back to JavaScript
     Napi::Error::New(env_, "Wrong number of arguments.").ThrowAsJavaScriptException();
     return;
   }
 
-  if (!info[1].IsFunction()) {
-    Napi::TypeError::New(env_, "Wrong arguments.").ThrowAsJavaScriptException();
+  int callbackArg = info.Length() == 1 ? 0 : 1;
+  if ((callbackArg == 1 && !info[0].IsObject()) || !info[callbackArg].IsFunction()) {
+    Napi::TypeError::New(env_, "Wrong arguments to buildKeyFilter(), must be: "\
+                               "optional options object, callback")
+                               .ThrowAsJavaScriptException();
     return;
   }
 
-  Napi::Object record = info[0].ToObject();
-  if (buf_) {
-    free(buf_);
+  // Each counter is a byte: the filter takes expectedKeys * countersPerKey bytes
+  double keys = 100000, counters = 10;
+  if (callbackArg == 1) {
+    Napi::Object options = info[0].As<Napi::Object>();
+    if (options.Get("expectedKeys").IsNumber())
+      keys = options.Get("expectedKeys").As<Napi::Number>().DoubleValue();
+    if (options.Get("countersPerKey").IsNumber())
+      counters = options.Get("countersPerKey").As<Napi::Number>().DoubleValue();
   }
-  buf_ = malloc(reclen_); //TODO: error
-  memset(buf_,0,reclen_);
-  char* buf = (char*)buf_;
-  for(auto i = layout_.begin(); i != layout_.end(); ++i) {
-    Napi::Value field = record.Get(&(i->name[0]));
-    if (i->type == LayoutItem::STRING || i->type == LayoutItem::HEXADECIMAL) {
-      std::string key = static_cast<std::string>(Napi::String (env_, field.ToString()));
-      if (i->type == LayoutItem::STRING) {
-        memcpy(buf, key.c_str(), key.length());
-      } else {
-        hexstrToBuffer(buf, i->maxLength, key.c_str());
-      }
-    } else {
-      Napi::TypeError::New(env_, "Unexpected JSON data type").ThrowAsJavaScriptException();
-      return;
-    }
-    buf += i->maxLength;
+  if (keys < 1 || counters < 1 || counters > 32) {
+    Napi::Error::New(env_, "buildKeyFilter: expectedKeys must be at least 1 "\
+                           "and countersPerKey between 1 and 32.").ThrowAsJavaScriptException();
+    return;
   }
 
+  keyfilter_ = std::make_shared<VsamKeyFilter>(keylen_, (size_t)keys, (unsigned)counters);
   uv_work_t* request = new uv_work_t;
   request->data = this;
-  cb_ = Napi::Persistent(info[1].As<Napi::Function>());
-  uv_queue_work(uv_default_loop(), request, Write, WriteCallback);
+  cb_ = Napi::Persistent(info[callbackArg].As<Napi::Function>());
+  TraceQueue("buildKeyFilter", keylen_);
+  uv_queue_work(uv_default_loop(), request, BuildKeyFilter, BuildKeyFilterCallback);
 }
 
 
-void VsamFile::Update(const Napi::CallbackInfo& info) {
-  if (info.Length() < 2) {
+void VsamFile::DropKeyFilter(const Napi::CallbackInfo& info) {
+  VsamKeyFilter::Drop(path_);
+}
+
+
+void VsamFile::DeleteRange(const Napi::CallbackInfo& info) {
+  if (info.Length() < 3) {
     // Throw an Error that is passed back to JavaScript
     Napi::Error::New(env_, "Wrong number of arguments.").ThrowAsJavaScriptException();
     return;
   }
 
-  if (!info[1].IsFunction()) {
-    Napi::TypeError::New(env_, "Wrong arguments.").ThrowAsJavaScriptException();
+  int callbackArg = info.Length() == 3 ? 2 : 3;
+  if ((callbackArg == 3 && !info[2].IsObject()) || !info[callbackArg].IsFunction()) {
+    Napi::TypeError::New(env_, "Wrong arguments to deleteRange(), must be: "\
+                               "start key, end key, optional options object, callback")
+                               .ThrowAsJavaScriptException();
     return;
   }
 
-  Napi::Object record = info[0].ToObject();
-  if (buf_) {
-    free(buf_);
-  }
-  buf_ = malloc(reclen_); //TODO: error
-  memset(buf_,0,reclen_);
-  char* buf = (char*)buf_;
-  for(auto i = layout_.begin(); i != layout_.end(); ++i) {
-    Napi::Value field = record.Get(&(i->name[0]));
-    if (i->type == LayoutItem::STRING || i->type == LayoutItem::HEXADECIMAL) {
-      std::string key = static_cast<std::string>(Napi::String (env_, field.ToString()));
-      if (i->type == LayoutItem::STRING) {
-        memcpy(buf, key.c_str(), key.length());
-      } else {
-        hexstrToBuffer(buf, i->maxLength, key.c_str());
-      }
-      buf += i->maxLength;
+  // A null start or end leaves that end of the range open
+  Napi::Object bounds = Napi::Object::New(env_);
+  if (!info[0].IsNull())
+    bounds.Set("start", info[0]);
+  if (!info[1].IsNull())
+    bounds.Set("end", info[1]);
+  Purge purge;
+  if (!ParseRange(bounds, purge.range))
+    return;
 
-    } else {
-      Napi::TypeError::New(env_, "Unexpected JSON data type").ThrowAsJavaScriptException();
-      return;
+  Napi::Function progress;
+  if (callbackArg == 3) {
+    Napi::Object options = info[2].As<Napi::Object>();
+    Napi::Value limit = options.Get("limit");
+    if (!limit.IsUndefined()) {
+      if (!limit.IsNumber() || limit.As<Napi::Number>().DoubleValue() < 1) {
+        Napi::TypeError::New(env_, "limit must be a positive number.").ThrowAsJavaScriptException();
+        return;
+      }
+      purge.limit = (size_t)limit.As<Napi::Number>().DoubleValue();
     }
+    purge.dryRun = options.Get("dryRun").ToBoolean().Value();
+    if (options.Get("progress").IsFunction())
+      progress = options.Get("progress").As<Napi::Function>();
   }
 
+  purge_ = purge;
+  if (!progress.IsEmpty())
+    progress_ = Napi::Persistent(progress);
   uv_work_t* request = new uv_work_t;
   request->data = this;
-  cb_ = Napi::Persistent(info[1].As<Napi::Function>());
-  uv_queue_work(uv_default_loop(), request, Update, UpdateCallback);
+  cb_ = Napi::Persistent(info[callbackArg].As<Napi::Function>());
+  TraceQueue("deleteRange", keylen_);
+  uv_queue_work(uv_default_loop(), request, DeleteRange, DeleteRangeCallback);
 }
 
+
 void VsamFile::FindEq(const Napi::CallbackInfo& info) {
   Find(info, __KEY_EQ);
 }
@@ -706,7 +2557,12 @@ void VsamFile::Find(const Napi::CallbackInfo& info, int equality) {
     keybuf_len_ = keybuf_len;
   }
   equality_ = equality;
+  const char* opname = equality == __KEY_EQ ? "find" : equality == __KEY_GE ? "findge"
+                       : equality == __KEY_FIRST ? "findfirst" : "findlast";
 
+  cur_ = active_;
+  // A string key is located with keylen_ bytes, whatever its text length
+  TraceQueue(opname, keybuf ? keybuf_len : keylen_);
   uv_queue_work(uv_default_loop(), request, Find, ReadCallback);
 }
 
@@ -725,10 +2581,21 @@ void VsamFile::Read(const Napi::CallbackInfo& info) {
   uv_work_t* request = new uv_work_t;
   request->data = this;
   cb_ = Napi::Persistent(info[0].As<Napi::Function>());
+  cur_ = active_;
+  TraceQueue("read", keylen_);
   uv_queue_work(uv_default_loop(), request, Read, ReadCallback);
 }
 
 
+Napi::Value VsamFile::Cursor(const Napi::CallbackInfo& info) {
+  if (stream_ == NULL) {
+    Napi::Error::New(env_, "VSAM file is not open.").ThrowAsJavaScriptException();
+    return env_.Null();
+  }
+  return VsamCursor::New(env_, Value());
+}
+
+
 void VsamFile::Dealloc(const Napi::CallbackInfo& info) {
   if (info.Length() < 1) {
     // Throw an Error that is passed back to JavaScript
@@ -788,3 +2655,18 @@ static const char* bufferToHexstr (char* hexstr, const char* hexbuf, const int h
      hexstr[j-1] = 0;
    return hexstr;
 }
+
+
+static double fieldToNumber (const char* buf, int len, bool binary) {
+   // hexadecimal fields are big-endian unsigned binary, strings are decimal text
+   if (binary) {
+     double v = 0;
+     for (int i=0; i<len; i++)
+       v = v*256 + (unsigned char)buf[i];
+     return v;
+   }
+   char str[len+1];
+   memcpy(str, buf, len);
+   str[len] = 0;
+   return strtod(str, NULL);
+}
@@ -5,11 +5,20 @@
 */
 
 #pragma once
+#include "VsamIndex.h"
 #include <napi.h>
 #include <uv.h>
 #include <node_object_wrap.h>
 #include <uv.h>
 #include <string>
+#include <memory>
+#include <unordered_map>
+
+class VsamCursor;
+class VsamSnapshot;
+class VsamChangeLog;
+class VsamChangeFeed;
+class VsamKeyFilter;
 
 class VsamFile : public Napi::ObjectWrap<VsamFile> {
  public:
@@ -18,10 +27,16 @@ class VsamFile : public Napi::ObjectWrap<VsamFile> {
 
   static Napi::Value OpenSync(const Napi::CallbackInfo& info);
   static Napi::Value AllocSync(const Napi::CallbackInfo& info);
-  static Napi::Boolean Exist(const Napi::CallbackInfo& info);
+  static Napi::Value OpenAsync(const Napi::CallbackInfo& info);
+  static Napi::Value AllocAsync(const Napi::CallbackInfo& info);
+  static Napi::Value Exist(const Napi::CallbackInfo& info);
   ~VsamFile();
 
  private:
+  friend class VsamCursor;
+  friend class VsamSnapshot;
+  friend class VsamChangeFeed;
+
   struct LayoutItem {
     enum DataType {
       STRING,
@@ -37,6 +52,99 @@ class VsamFile : public Napi::ObjectWrap<VsamFile> {
     }
   };
 
+  /* Saved stream position of the handle or of one of its cursors */
+  struct Position {
+    enum State {
+      START,        // nothing read yet, next read returns the first record
+      AT_RECORD,    // key is the last record read, found or written
+      AFTER_DELETE, // key was deleted, next read returns its successor
+      AT_END,       // a read hit end of file
+      NONE          // a find failed, there is no current record
+    };
+
+    State state;
+    std::vector<char> key;
+    Position(int keylen) : state(START), key(keylen) {}
+  };
+
+  /* One keyed mutation, as run by apply(), updateByKey(), deleteByKey() and upsert() */
+  struct KeyedOp {
+    enum Type {
+      WRITE,
+      UPDATE,
+      DELETE,
+      UPSERT
+    };
+
+    Type type;
+    std::vector<char> key;
+    std::vector<char> record;  // new image; UPDATE only applies fields in mask
+    std::vector<bool> mask;    // layout fields present in an UPDATE's record
+    std::vector<char> before;  // image replaced or deleted, for undo
+    bool done;
+    std::string errmsg;
+    KeyedOp() : type(WRITE), done(false) {}
+  };
+
+  /* Keys visited by a native scan: [start, end], or those sharing a prefix */
+  struct KeyRange {
+    std::vector<char> start;
+    std::vector<char> end;
+    size_t prefixlen;
+    bool from_first, to_last;
+    KeyRange() : prefixlen(0), from_first(true), to_last(true) {}
+  };
+
+  /* Request and progress of deleteRange(), carried from batch to batch */
+  struct Purge {
+    KeyRange range;       // start moves past each key visited
+    std::vector<char> last;  // last key visited, empty before the first
+    size_t limit, count;  // limit 0 for no limit
+    bool dryRun, done, failed, readerr;
+    std::string errmsg;
+    int rc, fdbk;         // __amrc feedback of the failed fread() or fdelrec()
+    Purge() : limit(0), count(0), dryRun(false), done(false), failed(false), readerr(false),
+              rc(0), fdbk(0) {}
+  };
+
+  /* Request and running totals of aggregate() */
+  struct Aggregation {
+    struct Metric {
+      enum Kind {
+        COUNT,
+        SUM,
+        MIN,
+        MAX
+      };
+
+      Kind kind;
+      int field;
+      std::string name;  // as given, e.g. "sum(amount)"
+    };
+
+    struct Group {
+      double count;
+      std::vector<double> sums;
+      std::vector<std::string> extremes;  // raw field bytes for min/max
+      Group() : count(0) {}
+    };
+
+    KeyRange range;
+    int groupBy;  // layout index, -1 for one group over the whole range
+    std::vector<Metric> metrics;
+    std::unordered_map<std::string, Group> groups;
+  };
+
+  /* State of an exist() call running on the worker pool */
+  struct ExistRequest {
+    Napi::Env env;
+    Napi::FunctionReference cb;
+    std::string path;
+    bool exists;
+    uint64_t queued;    // for VsamTrace
+    ExistRequest(Napi::Env e, std::string& p) : env(e), path(p), exists(false), queued(0) {}
+  };
+
   /* Entry point from Javascript */
   void Close(const Napi::CallbackInfo& info);
   void Read(const Napi::CallbackInfo& info);
@@ -49,6 +157,26 @@ class VsamFile : public Napi::ObjectWrap<VsamFile> {
   void Write(const Napi::CallbackInfo& info);
   void Delete(const Napi::CallbackInfo& info);
   void Dealloc(const Napi::CallbackInfo& info);
+  Napi::Value Cursor(const Napi::CallbackInfo& info);
+  void Apply(const Napi::CallbackInfo& info);
+  void MutateByKey(const Napi::CallbackInfo& info, int type);
+  void UpdateByKey(const Napi::CallbackInfo& info);
+  void DeleteByKey(const Napi::CallbackInfo& info);
+  void Upsert(const Napi::CallbackInfo& info);
+  void Aggregate(const Napi::CallbackInfo& info);
+  void CreateIndex(const Napi::CallbackInfo& info);
+  void DropIndex(const Napi::CallbackInfo& info);
+  void FindBy(const Napi::CallbackInfo& info);
+  void Snapshot(const Napi::CallbackInfo& info);
+  void CaptureChanges(const Napi::CallbackInfo& info);
+  void StopCapture(const Napi::CallbackInfo& info);
+  Napi::Value Changes(const Napi::CallbackInfo& info);
+  void Has(const Napi::CallbackInfo& info);
+  void HasMany(const Napi::CallbackInfo& info);
+  void Keys(const Napi::CallbackInfo& info);
+  void BuildKeyFilter(const Napi::CallbackInfo& info);
+  void DropKeyFilter(const Napi::CallbackInfo& info);
+  void DeleteRange(const Napi::CallbackInfo& info);
 
   /* Work functions */
   static void Open(uv_work_t* req);
@@ -59,6 +187,17 @@ class VsamFile : public Napi::ObjectWrap<VsamFile> {
   static void Update(uv_work_t* req);
   static void Write(uv_work_t* req);
   static void Delete(uv_work_t* req);
+  static void ExistWork(uv_work_t* req);
+  static void Apply(uv_work_t* req);
+  static void MutateByKey(uv_work_t* req);
+  static void Aggregate(uv_work_t* req);
+  static void CreateIndex(uv_work_t* req);
+  static void FindBy(uv_work_t* req);
+  static void Snapshot(uv_work_t* req);
+  static void Has(uv_work_t* req);
+  static void Keys(uv_work_t* req);
+  static void BuildKeyFilter(uv_work_t* req);
+  static void DeleteRange(uv_work_t* req);
 
   /* Work callback functions */
   static void OpenCallback(uv_work_t* req, int statusj);
@@ -68,9 +207,52 @@ class VsamFile : public Napi::ObjectWrap<VsamFile> {
   static void UpdateCallback(uv_work_t* req, int status);
   static void WriteCallback(uv_work_t* req, int status);
   static void DeleteCallback(uv_work_t* req, int status);
+  static void ExistCallback(uv_work_t* req, int status);
+  static void ApplyCallback(uv_work_t* req, int status);
+  static void MutateByKeyCallback(uv_work_t* req, int status);
+  static void AggregateCallback(uv_work_t* req, int status);
+  static void CreateIndexCallback(uv_work_t* req, int status);
+  static void SnapshotCallback(uv_work_t* req, int status);
+  static void HasCallback(uv_work_t* req, int status);
+  static void KeysCallback(uv_work_t* req, int status);
+  static void BuildKeyFilterCallback(uv_work_t* req, int status);
+  static void DeleteRangeCallback(uv_work_t* req, int status);
 
   /* Private methods */
-  static Napi::Value Construct(const Napi::CallbackInfo& info, bool alloc);
+  static Napi::Value Construct(const Napi::CallbackInfo& info, bool alloc, bool async = false);
+  static Napi::Value DecodeField(Napi::Env env, const LayoutItem& item, const char* buf);
+  static Napi::Object DecodeRecord(Napi::Env env, const std::vector<LayoutItem>& layout, const char* buf);
+  void OpenStream();
+  int CloseStream();
+  void Reposition(bool restore);
+  void SavePosition(Position::State state, const char* record);
+  bool EncodeField(const LayoutItem& item, Napi::Value value, char* buf);
+  bool EncodeRecord(Napi::Object record, char* buf, std::vector<bool>* mask);
+  bool EncodeKey(Napi::Value value, char* buf, size_t* len = NULL);
+  static bool EncodeKey(Napi::Env env, LayoutItem::DataType type, unsigned keylen,
+                        Napi::Value value, char* buf, size_t* len = NULL);
+  bool ParseOp(Napi::Value value, KeyedOp& op);
+  bool EncodeOp(KeyedOp& op, Napi::Value key, Napi::Value record);
+  bool LocateRecord(const char* key, char* record);
+  void TraceQueue(const char* op, unsigned keylen);
+  void TraceWork();
+  void TraceIO(uint64_t start, const char* call);
+  void PatchRecord(char* record, const KeyedOp& op);
+  bool ApplyOp(KeyedOp& op);
+  bool UndoOp(KeyedOp& op);
+  bool Indexed();
+  bool IndexConflict(const char* record, std::string& errmsg);
+  void IndexReplace(const char* before, const char* after);
+  bool Tracked();
+  void Changed(const char* before, const char* after);
+  void KeyChanged(const char* key, bool added);
+  int FieldIndex(const std::string& name);
+  unsigned FieldOffset(int field);
+  bool ParseRange(Napi::Value value, KeyRange& range);
+  static bool ParseRange(Napi::Env env, LayoutItem::DataType type, unsigned keylen,
+                         Napi::Value value, KeyRange& range);
+  bool LocateRange(const KeyRange& range);
+  bool InRange(const KeyRange& range, const char* key);
 
   /* Data */
   static Napi::FunctionReference constructor_;
@@ -83,10 +265,42 @@ class VsamFile : public Napi::ObjectWrap<VsamFile> {
   int keybuf_len_;
   std::vector<LayoutItem> layout_;
   int key_i_;
-  unsigned keylen_, reclen_;
+  unsigned keyoff_, keylen_, reclen_;
   FILE *stream_;
+  bool alloc_;
+  bool registered_; // stream_ is accounted for in VsamRegistry
   void *buf_;
   int lastrc_;
   int equality_;
   std::string errmsg_;
+  std::vector<KeyedOp> ops_;
+  bool atomic_;
+  Aggregation agg_;
+  std::vector<VsamIndex> indexes_;
+  uv_mutex_t indexmutex_;  // indexes_ changes on the loop thread while ops run on workers
+  std::unique_ptr<VsamIndex> building_;
+  double buildms_;
+  std::string findname_;
+  std::string findvalue_;
+  std::string snappath_;
+  const char* opname_;  // op in flight, for VsamTrace
+  unsigned opkeylen_;
+  uint64_t queued_;
+  std::shared_ptr<VsamChangeLog> changes_;  // null unless capture is enabled
+  unsigned changesgen_;
+  std::shared_ptr<VsamKeyFilter> filter_;     // null unless a key filter is installed
+  unsigned filtergen_;
+  std::vector<char> probes_;  // keys for has() and hasMany(), keylen_ bytes each
+  std::vector<bool> found_;
+  bool many_;
+  std::vector<char> keys_;    // keys found by keys(), keylen_ bytes each
+  KeyRange range_;
+  std::shared_ptr<VsamKeyFilter> keyfilter_;  // filter being built
+  size_t filterkeys_;
+  Purge purge_;
+  Napi::FunctionReference progress_;
+  std::shared_ptr<Position> pos_;    // the handle's own position
+  std::shared_ptr<Position> active_; // position the next queued op will use
+  std::shared_ptr<Position> cur_;    // position of the op in flight
+  std::shared_ptr<Position> owner_;  // position the stream currently reflects
 };
@@ -0,0 +1,96 @@
+/*
+ * Licensed Materials - Property of IBM
+ * (C) Copyright IBM Corp. 2017. All Rights Reserved.
+ * US Government Users Restricted Rights - Use, duplication or disclosure restricted by GSA ADP Schedule Contract with IBM Corp.
+*/
+#include "VsamIndex.h"
+
+static size_t heapBytes (const std::string& s) {
+  // short strings live inside the string object itself
+  const char* p = s.data();
+  if (p >= (const char*)&s && p < (const char*)(&s + 1))
+    return 0;
+  return s.capacity() + 1;
+}
+
+
+VsamIndex::VsamIndex(const std::string& name, unsigned off, unsigned len,
+                     unsigned keyoff, unsigned keylen, bool unique)
+: name_(name),
+    off_(off),
+    len_(len),
+    keyoff_(keyoff),
+    keylen_(keylen),
+    unique_(unique) {
+}
+
+
+bool VsamIndex::Add(const char* record) {
+  // Fails only for a value a unique index already holds for another key
+  if (unique_ && Conflicts(record))
+    return false;
+  entries_.insert(std::make_pair(std::string(record + off_, len_),
+                                 std::string(record + keyoff_, keylen_)));
+  return true;
+}
+
+
+void VsamIndex::Remove(const char* record) {
+  std::pair<EntryMap::iterator, EntryMap::iterator> range =
+      entries_.equal_range(std::string(record + off_, len_));
+  for (EntryMap::iterator i = range.first; i != range.second; ++i) {
+    if (!i->second.compare(0, keylen_, record + keyoff_, keylen_)) {
+      entries_.erase(i);
+      return;
+    }
+  }
+}
+
+
+void VsamIndex::Replace(const char* before, const char* after) {
+  if (before)
+    Remove(before);
+  if (after)
+    entries_.insert(std::make_pair(std::string(after + off_, len_),
+                                   std::string(after + keyoff_, keylen_)));
+}
+
+
+bool VsamIndex::Conflicts(const char* record) const {
+  if (!unique_)
+    return false;
+  std::pair<EntryMap::const_iterator, EntryMap::const_iterator> range =
+      entries_.equal_range(std::string(record + off_, len_));
+  for (EntryMap::const_iterator i = range.first; i != range.second; ++i) {
+    if (i->second.compare(0, keylen_, record + keyoff_, keylen_))
+      return true;
+  }
+  return false;
+}
+
+
+bool VsamIndex::Lookup(const char* value, std::string& key) const {
+  // Of several matches, the lowest primary key wins
+  std::pair<EntryMap::const_iterator, EntryMap::const_iterator> range =
+      entries_.equal_range(std::string(value, len_));
+  if (range.first == range.second)
+    return false;
+  key = range.first->second;
+  for (EntryMap::const_iterator i = range.first; i != range.second; ++i) {
+    if (i->second < key)
+      key = i->second;
+  }
+  return true;
+}
+
+
+size_t VsamIndex::Bytes() const {
+  // Estimate: bucket array, one node per entry (link, cached hash, pair)
+  // and whatever the two strings of each entry keep on the heap.
+  size_t node = sizeof(void*) + sizeof(size_t) + sizeof(EntryMap::value_type);
+  size_t bytes = sizeof(*this) + entries_.bucket_count() * sizeof(void*) +
+                 entries_.size() * node;
+  for (EntryMap::const_iterator i = entries_.begin(); i != entries_.end(); ++i)
+    bytes += heapBytes(i->first) + heapBytes(i->second);
+  return bytes;
+}
@@ -0,0 +1,38 @@
+/*
+ * Licensed Materials - Property of IBM
+ * (C) Copyright IBM Corp. 2017. All Rights Reserved.
+ * US Government Users Restricted Rights - Use, duplication or disclosure restricted by GSA ADP Schedule Contract with IBM Corp.
+*/
+
+#pragma once
+#include <string>
+#include <unordered_map>
+
+/* In-memory secondary index of a VsamFile: maps the bytes of one non-key
+ * field to the primary keys of the records holding them. Records are passed
+ * in as raw fread() images and the index picks out both fields itself. */
+class VsamIndex {
+ public:
+  VsamIndex(const std::string& name, unsigned off, unsigned len,
+            unsigned keyoff, unsigned keylen, bool unique);
+
+  const std::string& Name() const { return name_; }
+  bool Unique() const { return unique_; }
+  size_t Entries() const { return entries_.size(); }
+  size_t Bytes() const;
+
+  bool Add(const char* record);
+  void Remove(const char* record);
+  void Replace(const char* before, const char* after);
+  bool Conflicts(const char* record) const;
+  bool Lookup(const char* value, std::string& key) const;
+
+ private:
+  typedef std::unordered_multimap<std::string, std::string> EntryMap;
+
+  std::string name_;
+  unsigned off_, len_;        // indexed field within the record
+  unsigned keyoff_, keylen_;  // primary key within the record
+  bool unique_;
+  EntryMap entries_;
+};
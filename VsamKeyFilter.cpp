@@ -0,0 +1,156 @@
+/*
+ * Licensed Materials - Property of IBM
+ * (C) Copyright IBM Corp. 2017. All Rights Reserved.
+ * US Government Users Restricted Rights - Use, duplication or disclosure restricted by GSA ADP Schedule Contract with IBM Corp.
+*/
+#include "VsamKeyFilter.h"
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+uv_mutex_t VsamKeyFilter::mutex_;
+std::atomic<unsigned> VsamKeyFilter::generation_(0);
+std::map<std::string, std::shared_ptr<VsamKeyFilter> > VsamKeyFilter::filters_;
+
+static const unsigned kMaxHashes = 16;
+
+
+VsamKeyFilter::VsamKeyFilter(unsigned keylen, size_t keys, unsigned countersPerKey)
+: keylen_(keylen),
+    hashes_(std::max(1u, std::min(kMaxHashes, (unsigned)lround(countersPerKey * 0.693)))),
+    counters_(std::max<size_t>(keys * countersPerKey, 64)),
+    ready_(false),
+    stale_(false) {
+  uv_mutex_init(&scanmutex_);
+  for (auto i = counters_.begin(); i != counters_.end(); ++i)
+    i->store(0, std::memory_order_relaxed);
+}
+
+
+VsamKeyFilter::~VsamKeyFilter() {
+  uv_mutex_destroy(&scanmutex_);
+}
+
+
+void VsamKeyFilter::Init(Napi::Env env, Napi::Object exports) {
+  static bool initialized = false;
+  if (!initialized) {
+    uv_mutex_init(&mutex_);
+    initialized = true;
+  }
+}
+
+
+void VsamKeyFilter::Install(const std::string& path,
+                            const std::shared_ptr<VsamKeyFilter>& filter) {
+  uv_mutex_lock(&mutex_);
+  filters_[path] = filter;
+  // Ordered before the scan's reads: see VsamFile::KeyChanged()
+  generation_.fetch_add(1, std::memory_order_seq_cst);
+  uv_mutex_unlock(&mutex_);
+}
+
+
+void VsamKeyFilter::Drop(const std::string& path,
+                         const std::shared_ptr<VsamKeyFilter>& filter) {
+  // With a filter given, only drop it if a rebuild hasn't replaced it
+  uv_mutex_lock(&mutex_);
+  auto i = filters_.find(path);
+  if (i != filters_.end() && (!filter || i->second == filter)) {
+    filters_.erase(i);
+    generation_.fetch_add(1, std::memory_order_release);
+  }
+  uv_mutex_unlock(&mutex_);
+}
+
+
+std::shared_ptr<VsamKeyFilter> VsamKeyFilter::Find(const std::string& path) {
+  std::shared_ptr<VsamKeyFilter> result;
+  uv_mutex_lock(&mutex_);
+  auto i = filters_.find(path);
+  if (i != filters_.end())
+    result = i->second;
+  uv_mutex_unlock(&mutex_);
+  return result;
+}
+
+
+void VsamKeyFilter::Slots(const char* key, size_t* slots) const {
+  // FNV-1a, then double hashing on its two halves
+  uint64_t h = 14695981039346656037ULL;
+  for (unsigned i = 0; i < keylen_; ++i) {
+    h ^= (unsigned char)key[i];
+    h *= 1099511628211ULL;
+  }
+  uint64_t h1 = h & 0xffffffff;
+  uint64_t h2 = (h >> 32) | 1;
+  for (unsigned i = 0; i < hashes_; ++i)
+    slots[i] = (h1 + i * h2) % counters_.size();
+}
+
+
+bool VsamKeyFilter::MayContain(const char* key) const {
+  size_t slots[kMaxHashes];
+  Slots(key, slots);
+  for (unsigned i = 0; i < hashes_; ++i) {
+    if (counters_[slots[i]].load(std::memory_order_relaxed) == 0)
+      return false;
+  }
+  return true;
+}
+
+
+void VsamKeyFilter::Add(const char* key) {
+  size_t slots[kMaxHashes];
+  Slots(key, slots);
+  for (unsigned i = 0; i < hashes_; ++i) {
+    std::atomic<uint8_t>& counter = counters_[slots[i]];
+    uint8_t c = counter.load(std::memory_order_relaxed);
+    while (c < 255 && !counter.compare_exchange_weak(c, c + 1, std::memory_order_relaxed))
+      ;
+  }
+}
+
+
+bool VsamKeyFilter::Remove(const char* key) {
+  if (stale_.load(std::memory_order_acquire))
+    return false;
+  if (!ready_.load(std::memory_order_acquire)) {
+    uv_mutex_lock(&scanmutex_);
+    bool counted = !scanned_.empty() && memcmp(key, &scanned_[0], keylen_) <= 0;
+    uv_mutex_unlock(&scanmutex_);
+    if (!counted)
+      return true;
+  }
+
+  // Decrementing for a key that was never counted could rule out one that was
+  if (!MayContain(key)) {
+    stale_.store(true, std::memory_order_release);
+    return false;
+  }
+
+  size_t slots[kMaxHashes];
+  Slots(key, slots);
+  for (unsigned i = 0; i < hashes_; ++i) {
+    // A saturated counter no longer knows how many keys it holds
+    std::atomic<uint8_t>& counter = counters_[slots[i]];
+    uint8_t c = counter.load(std::memory_order_relaxed);
+    while (c > 0 && c < 255 &&
+           !counter.compare_exchange_weak(c, c - 1, std::memory_order_relaxed))
+      ;
+  }
+  return true;
+}
+
+
+void VsamKeyFilter::Scanned(const char* key) {
+  uv_mutex_lock(&scanmutex_);
+  scanned_.assign(key, key + keylen_);
+  Add(key);
+  uv_mutex_unlock(&scanmutex_);
+}
+
+
+void VsamKeyFilter::Built() {
+  ready_.store(true, std::memory_order_release);
+}
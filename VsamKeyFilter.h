@@ -0,0 +1,67 @@
+/*
+ * Licensed Materials - Property of IBM
+ * (C) Copyright IBM Corp. 2017. All Rights Reserved.
+ * US Government Users Restricted Rights - Use, duplication or disclosure restricted by GSA ADP Schedule Contract with IBM Corp.
+*/
+
+#pragma once
+#include <napi.h>
+#include <uv.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+/* Counting Bloom filter over the primary keys of one dataset, shared by every
+ * handle in the process. A miss means the key is definitely not in the dataset;
+ * a hit still has to be confirmed with flocate(). Counters are 8 bits, updated
+ * with compare-and-swap, and stay at 255 once they saturate.
+ *
+ * The filter is installed before the key scan that fills it, so writes made
+ * meanwhile are counted. Until the scan completes, removing a key the scan has
+ * not reached yet is ignored, as the scan will never count it.
+ *
+ * Removing a key the filter rules out means the dataset holds records it never
+ * counted, written outside the process: the filter goes stale, answers no more
+ * queries, and Remove() returns false for the caller to drop it. */
+class VsamKeyFilter {
+ public:
+  VsamKeyFilter(unsigned keylen, size_t keys, unsigned countersPerKey);
+  ~VsamKeyFilter();
+
+  static void Init(Napi::Env env, Napi::Object exports);
+  static void Install(const std::string& path, const std::shared_ptr<VsamKeyFilter>& filter);
+  static void Drop(const std::string& path,
+                   const std::shared_ptr<VsamKeyFilter>& filter = nullptr);
+  static std::shared_ptr<VsamKeyFilter> Find(const std::string& path);
+  static unsigned Generation() { return generation_.load(std::memory_order_acquire); }
+
+  bool Ready() const {
+    return ready_.load(std::memory_order_acquire) && !stale_.load(std::memory_order_acquire);
+  }
+  unsigned Hashes() const { return hashes_; }
+  size_t Bytes() const { return counters_.size(); }
+
+  bool MayContain(const char* key) const;
+  void Add(const char* key);
+  bool Remove(const char* key);
+  void Scanned(const char* key);
+  void Built();
+
+ private:
+  void Slots(const char* key, size_t* slots) const;
+
+  /* Data */
+  static uv_mutex_t mutex_;
+  static std::atomic<unsigned> generation_;
+  static std::map<std::string, std::shared_ptr<VsamKeyFilter> > filters_;
+
+  unsigned keylen_;
+  unsigned hashes_;
+  std::vector<std::atomic<uint8_t> > counters_;
+  std::atomic<bool> ready_;
+  std::atomic<bool> stale_;     // out of step with the dataset, see Remove()
+  uv_mutex_t scanmutex_;        // guards scanned_ until ready_
+  std::vector<char> scanned_;   // last key counted by the scan, empty before the first
+};
@@ -0,0 +1,175 @@
+/*
+ * Licensed Materials - Property of IBM
+ * (C) Copyright IBM Corp. 2017. All Rights Reserved.
+ * US Government Users Restricted Rights - Use, duplication or disclosure restricted by GSA ADP Schedule Contract with IBM Corp.
+*/
+#include "VsamRegistry.h"
+#include <algorithm>
+
+uv_mutex_t VsamRegistry::mutex_;
+uv_timer_t* VsamRegistry::timer_ = NULL;
+uint64_t VsamRegistry::idle_ms_ = 0;
+bool VsamRegistry::enabled_ = false;
+VsamRegistry::EntryMap VsamRegistry::entries_;
+
+static uint64_t now_ms() {
+  return uv_hrtime() / 1000000;
+}
+
+
+void VsamRegistry::Init(Napi::Env env, Napi::Object exports) {
+  static bool initialized = false;
+  if (!initialized) {
+    uv_mutex_init(&mutex_);
+    initialized = true;
+  }
+  exports.Set(Napi::String::New(env, "enableRegistry"),
+              Napi::Function::New(env, VsamRegistry::Enable));
+  exports.Set(Napi::String::New(env, "disableRegistry"),
+              Napi::Function::New(env, VsamRegistry::Disable));
+}
+
+
+bool VsamRegistry::Enabled() {
+  uv_mutex_lock(&mutex_);
+  bool enabled = enabled_;
+  uv_mutex_unlock(&mutex_);
+  return enabled;
+}
+
+
+FILE* VsamRegistry::Acquire(const std::string& path, const std::string& mode,
+                            unsigned* keylen, unsigned* reclen) {
+  FILE* stream = NULL;
+  uv_mutex_lock(&mutex_);
+  if (enabled_) {
+    EntryMap::iterator i = entries_.find(std::make_pair(path, mode));
+    if (i != entries_.end() && !i->second.idle.empty()) {
+      // Most recently parked first, so the oldest ones can age out.
+      stream = i->second.idle.back().stream;
+      i->second.idle.pop_back();
+      i->second.refs++;
+      *keylen = i->second.keylen;
+      *reclen = i->second.reclen;
+    }
+  }
+  uv_mutex_unlock(&mutex_);
+  return stream;
+}
+
+
+void VsamRegistry::Add(const std::string& path, const std::string& mode,
+                       unsigned keylen, unsigned reclen) {
+  uv_mutex_lock(&mutex_);
+  if (enabled_) {
+    Entry& e = entries_[std::make_pair(path, mode)];
+    e.keylen = keylen;
+    e.reclen = reclen;
+    e.refs++;
+  }
+  uv_mutex_unlock(&mutex_);
+}
+
+
+bool VsamRegistry::Release(const std::string& path, const std::string& mode, FILE* stream) {
+  bool parked = false;
+  uv_mutex_lock(&mutex_);
+  EntryMap::iterator i = entries_.find(std::make_pair(path, mode));
+  if (i != entries_.end()) {
+    i->second.refs--;
+    if (enabled_) {
+      i->second.idle.push_back(IdleStream(stream, now_ms()));
+      parked = true;
+    } else if (i->second.refs <= 0 && i->second.idle.empty()) {
+      entries_.erase(i);
+    }
+  }
+  uv_mutex_unlock(&mutex_);
+  return parked;
+}
+
+
+void VsamRegistry::Purge(const std::string& path) {
+  uv_mutex_lock(&mutex_);
+  for (EntryMap::iterator i = entries_.begin(); i != entries_.end(); ) {
+    if (i->first.first == path) {
+      for (auto j = i->second.idle.begin(); j != i->second.idle.end(); ++j)
+        fclose(j->stream);
+      i->second.idle.clear();
+    }
+    if (i->second.refs <= 0 && i->second.idle.empty())
+      i = entries_.erase(i);
+    else
+      ++i;
+  }
+  uv_mutex_unlock(&mutex_);
+}
+
+
+void VsamRegistry::CloseIdle(uint64_t older_than) {
+  uv_mutex_lock(&mutex_);
+  for (EntryMap::iterator i = entries_.begin(); i != entries_.end(); ) {
+    std::vector<IdleStream>& idle = i->second.idle;
+    for (auto j = idle.begin(); j != idle.end(); ) {
+      if (j->since <= older_than) {
+        fclose(j->stream);
+        j = idle.erase(j);
+      } else {
+        ++j;
+      }
+    }
+    if (i->second.refs <= 0 && idle.empty())
+      i = entries_.erase(i);
+    else
+      ++i;
+  }
+  uv_mutex_unlock(&mutex_);
+}
+
+
+void VsamRegistry::Sweep(uv_timer_t* timer) {
+  uint64_t now = now_ms();
+  if (now > idle_ms_)
+    CloseIdle(now - idle_ms_);
+}
+
+
+void VsamRegistry::Enable(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  if (info.Length() > 1 || (info.Length() == 1 && !info[0].IsNumber())) {
+    Napi::Error::New(env, "Wrong arguments to enableRegistry(), must be: "\
+                          "optional idle timeout in milliseconds").ThrowAsJavaScriptException();
+    return;
+  }
+  uint64_t idle_ms = info.Length() == 1 ? info[0].As<Napi::Number>().Uint32Value() : 30000;
+  if (idle_ms == 0) {
+    Napi::Error::New(env, "Idle timeout must be greater than 0.").ThrowAsJavaScriptException();
+    return;
+  }
+
+  uv_mutex_lock(&mutex_);
+  enabled_ = true;
+  idle_ms_ = idle_ms;
+  uv_mutex_unlock(&mutex_);
+
+  if (timer_ == NULL) {
+    timer_ = new uv_timer_t;
+    uv_timer_init(uv_default_loop(), timer_);
+    // Parked streams must not keep the process alive.
+    uv_unref((uv_handle_t*)timer_);
+  }
+  // Sweep often enough that a stream outlives its timeout by at most a tenth
+  uint64_t interval = std::max<uint64_t>(idle_ms / 10, 1);
+  uv_timer_start(timer_, Sweep, interval, interval);
+}
+
+
+void VsamRegistry::Disable(const Napi::CallbackInfo& info) {
+  uv_mutex_lock(&mutex_);
+  enabled_ = false;
+  uv_mutex_unlock(&mutex_);
+
+  if (timer_ != NULL)
+    uv_timer_stop(timer_);
+  CloseIdle(UINT64_MAX);
+}
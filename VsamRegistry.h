@@ -0,0 +1,64 @@
+/*
+ * Licensed Materials - Property of IBM
+ * (C) Copyright IBM Corp. 2017. All Rights Reserved.
+ * US Government Users Restricted Rights - Use, duplication or disclosure restricted by GSA ADP Schedule Contract with IBM Corp.
+*/
+
+#pragma once
+#include <napi.h>
+#include <uv.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <map>
+
+/* Process-wide pool of open streams, keyed by dataset name and fopen() mode.
+ * A handle that closes parks its stream here instead of calling fclose(), and
+ * the next open of the same dataset and mode takes it over together with the
+ * attributes fldata() reported, skipping the catalog lookup and open. Streams
+ * that stay idle longer than the configured timeout are closed. */
+class VsamRegistry {
+ public:
+  static void Init(Napi::Env env, Napi::Object exports);
+
+  static bool Enabled();
+  static FILE* Acquire(const std::string& path, const std::string& mode,
+                       unsigned* keylen, unsigned* reclen);
+  static void Add(const std::string& path, const std::string& mode,
+                  unsigned keylen, unsigned reclen);
+  static bool Release(const std::string& path, const std::string& mode, FILE* stream);
+  static void Purge(const std::string& path);
+
+ private:
+  struct IdleStream {
+    FILE* stream;
+    uint64_t since;
+    IdleStream(FILE* s, uint64_t t) : stream(s), since(t) {}
+  };
+
+  struct Entry {
+    unsigned keylen, reclen;
+    int refs;                      // handles currently holding a stream
+    std::vector<IdleStream> idle;  // streams parked by closed handles
+    Entry() : keylen(0), reclen(0), refs(0) {}
+  };
+
+  typedef std::map<std::pair<std::string, std::string>, Entry> EntryMap;
+
+  /* Entry point from Javascript */
+  static void Enable(const Napi::CallbackInfo& info);
+  static void Disable(const Napi::CallbackInfo& info);
+
+  /* Timer callback */
+  static void Sweep(uv_timer_t* timer);
+
+  /* Private methods */
+  static void CloseIdle(uint64_t older_than);
+
+  /* Data */
+  static uv_mutex_t mutex_;
+  static uv_timer_t* timer_;
+  static uint64_t idle_ms_;
+  static bool enabled_;
+  static EntryMap entries_;
+};
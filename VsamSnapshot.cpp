@@ -0,0 +1,388 @@
+/*
+ * Licensed Materials - Property of IBM
+ * (C) Copyright IBM Corp. 2017. All Rights Reserved.
+ * US Government Users Restricted Rights - Use, duplication or disclosure restricted by GSA ADP Schedule Contract with IBM Corp.
+*/
+#include "VsamSnapshot.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <sstream>
+#include <algorithm>
+
+Napi::FunctionReference VsamSnapshot::constructor_;
+
+static const char snapshotMagic[8] = { 'V','S','A','M','S','N','A','P' };
+static const uint32_t snapshotVersion = 2;
+static const uint32_t snapshotStride = 64;
+
+
+bool VsamSnapshot::Build(VsamFile* file, const std::string& path, std::string& errmsg) {
+  // Runs on the worker pool. The new file only replaces path once complete,
+  // so readers of the previous snapshot are never shown a partial one. Each
+  // build writes its own file, so builds of the same path can overlap.
+  std::string tmp = path + ".XXXXXX";
+  int fd = mkstemp(&tmp[0]);
+  if (fd < 0) {
+    errmsg = "Failed to create snapshot " + tmp + ": " + strerror(errno);
+    return false;
+  }
+  FILE* out = NULL;
+  if (fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) != 0 ||
+      (out = fdopen(fd, "wb")) == NULL) {
+    errmsg = "Failed to create snapshot " + tmp + ": " + strerror(errno);
+    close(fd);
+    remove(tmp.c_str());
+    return false;
+  }
+
+  // One line per field: the name is length-prefixed, as it may hold blanks
+  std::ostringstream schema;
+  for (auto i = file->layout_.begin(); i != file->layout_.end(); ++i) {
+    const char* name = &(i->name[0]);
+    schema << strlen(name) << ':' << name << ' '
+           << (i->type == VsamFile::LayoutItem::HEXADECIMAL ? "hexadecimal" : "string") << ' '
+           << i->maxLength << '\n';
+  }
+  std::string text = schema.str();
+
+  Header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, snapshotMagic, sizeof(h.magic));
+  h.version = snapshotVersion;
+  h.key_i = file->key_i_;
+  h.keyoff = file->keyoff_;
+  h.keylen = file->keylen_;
+  h.reclen = file->reclen_;
+  h.stride = snapshotStride;
+  h.schema_off = sizeof(h);
+  h.schema_len = text.size();
+  h.data_off = h.schema_off + h.schema_len;
+
+  bool ok = fwrite(&h, sizeof(h), 1, out) == 1 &&
+            fwrite(text.data(), 1, text.size(), out) == text.size();
+
+  std::vector<char> index;
+  char key[h.keylen];
+  char rec[h.reclen];
+  bool readerr = false;
+  if (ok && flocate(file->stream_, key, h.keylen, __KEY_FIRST) == 0) {
+    while (ok && fread(rec, h.reclen, 1, file->stream_) == 1) {
+      if (h.records % h.stride == 0)
+        index.insert(index.end(), rec + h.keyoff, rec + h.keyoff + h.keylen);
+      ok = fwrite(rec, h.reclen, 1, out) == 1;
+      h.records++;
+    }
+    // A short read is only the end of the data if it hit end of file
+    if (ok && ferror(file->stream_)) {
+      __amrc_type currErr = *__amrc;
+      char ebuf[64];
+      sprintf(ebuf, " (R15=%d, reason=%d)", currErr.__code.__feedback.__rc,
+              currErr.__code.__feedback.__fdbk);
+      errmsg = std::string("Failed to read dataset for snapshot") + ebuf;
+      clearerr(file->stream_);
+      readerr = true;
+      ok = false;
+    }
+  }
+  h.index_off = h.data_off + h.records * h.reclen;
+  h.index_entries = index.size() / h.keylen;
+
+  ok = ok && (index.empty() || fwrite(&index[0], 1, index.size(), out) == index.size());
+  ok = ok && fseek(out, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, out) == 1;
+  ok = ok && fflush(out) == 0 && fsync(fileno(out)) == 0;
+  int err = errno;
+  if (fclose(out) != 0 && ok) {
+    ok = false;
+    err = errno;
+  }
+  if (ok && rename(tmp.c_str(), path.c_str()) != 0) {
+    ok = false;
+    err = errno;
+  }
+  if (!ok) {
+    remove(tmp.c_str());
+    if (!readerr)
+      errmsg = std::string("Failed to write snapshot: ") + strerror(err);
+  }
+  return ok;
+}
+
+
+VsamSnapshot::VsamSnapshot(const Napi::CallbackInfo& info)
+: Napi::ObjectWrap<VsamSnapshot>(info),
+    env_(info.Env()),
+    base_(NULL),
+    size_(0) {
+  Napi::HandleScope scope(env_);
+
+  if (info.Length() != 1 || !info[0].IsString()) {
+    Napi::Error::New(env_, "Wrong number of arguments to VsamSnapshot::VsamSnapshot")
+        .ThrowAsJavaScriptException();
+    return;
+  }
+
+  path_ = static_cast<std::string>(info[0].As<Napi::String>());
+  Map(errmsg_);
+}
+
+
+VsamSnapshot::~VsamSnapshot() {
+  Unmap();
+}
+
+
+bool VsamSnapshot::Map(std::string& errmsg) {
+  int fd = open(path_.c_str(), O_RDONLY);
+  if (fd < 0) {
+    errmsg = "Failed to open snapshot: " + std::string(strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Header)) {
+    close(fd);
+    errmsg = "Not a snapshot file";
+    return false;
+  }
+  void* base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    errmsg = "Failed to map snapshot: " + std::string(strerror(errno));
+    return false;
+  }
+
+  // Check every offset and length lookups rely on, without overflowing
+  Header h;
+  memcpy(&h, base, sizeof(h));
+  uint64_t size = st.st_size;
+  if (memcmp(h.magic, snapshotMagic, sizeof(h.magic)) || h.version != snapshotVersion ||
+      h.keylen == 0 || h.reclen == 0 || h.stride == 0 ||
+      h.keyoff > h.reclen || h.keylen > h.reclen - h.keyoff ||
+      h.schema_off < sizeof(h) || h.schema_off > h.data_off ||
+      h.schema_len > h.data_off - h.schema_off ||
+      h.data_off > h.index_off || h.records > (h.index_off - h.data_off) / h.reclen ||
+      h.index_off > size || h.index_entries > (size - h.index_off) / h.keylen ||
+      h.index_entries != (h.records + h.stride - 1) / h.stride) {
+    munmap(base, st.st_size);
+    errmsg = "Not a snapshot file";
+    return false;
+  }
+
+  std::vector<VsamFile::LayoutItem> layout;
+  std::istringstream schema(std::string((char*)base + h.schema_off, h.schema_len));
+  std::string name, type;
+  size_t namelen;
+  char colon;
+  int maxLength;
+  uint32_t reclen = 0;    // of the fields parsed so far
+  bool valid = true;
+  while (valid && !(schema >> std::ws).eof()) {
+    valid = schema >> namelen >> colon && colon == ':' && namelen <= h.schema_len;
+    if (valid) {
+      name.resize(namelen);
+      valid = schema.read(&name[0], namelen) && schema >> type >> maxLength;
+    }
+    // Decoding reads every field of a record, and the key field at keyoff
+    valid = valid && maxLength > 0 && (uint32_t)maxLength <= h.reclen - reclen;
+    if (valid) {
+      if (layout.size() == h.key_i)
+        valid = reclen == h.keyoff && (uint32_t)maxLength == h.keylen;
+      reclen += maxLength;
+      layout.push_back(VsamFile::LayoutItem(name, maxLength,
+          type == "hexadecimal" ? VsamFile::LayoutItem::HEXADECIMAL : VsamFile::LayoutItem::STRING));
+    }
+  }
+  if (!valid || layout.size() <= h.key_i) {
+    munmap(base, st.st_size);
+    errmsg = "Not a snapshot file";
+    return false;
+  }
+
+  Unmap();
+  base_ = (char*)base;
+  size_ = st.st_size;
+  ino_ = st.st_ino;
+  mtime_ = st.st_mtime;
+  header_ = h;
+  layout_.swap(layout);
+  return true;
+}
+
+
+void VsamSnapshot::Unmap() {
+  if (base_ != NULL)
+    munmap(base_, size_);
+  base_ = NULL;
+  size_ = 0;
+}
+
+
+const char* VsamSnapshot::Record(uint64_t i) const {
+  return base_ + header_.data_off + i * header_.reclen;
+}
+
+
+uint64_t VsamSnapshot::LowerBound(const char* key) const {
+  // Index of the first record whose key is >= key: pick the block from the
+  // sparse index, then search the records inside it.
+  const char* index = base_ + header_.index_off;
+  const unsigned keylen = header_.keylen;
+  uint64_t lo = 0, hi = header_.index_entries;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (memcmp(index + mid * keylen, key, keylen) <= 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0)
+    return 0;
+
+  uint64_t first = (lo - 1) * header_.stride;
+  uint64_t last = std::min<uint64_t>(lo * header_.stride, header_.records);
+  while (first < last) {
+    uint64_t mid = first + (last - first) / 2;
+    if (memcmp(Record(mid) + header_.keyoff, key, keylen) < 0)
+      first = mid + 1;
+    else
+      last = mid;
+  }
+  return first;
+}
+
+
+void VsamSnapshot::Init(Napi::Env env, Napi::Object exports) {
+  Napi::HandleScope scope(env);
+
+  Napi::Function func = DefineClass(env, "VsamSnapshot", {
+    InstanceMethod("find", &VsamSnapshot::FindEq),
+    InstanceMethod("findeq", &VsamSnapshot::FindEq),
+    InstanceMethod("findge", &VsamSnapshot::FindGe),
+    InstanceMethod("scan", &VsamSnapshot::Scan),
+    InstanceMethod("refresh", &VsamSnapshot::Refresh),
+    InstanceMethod("close", &VsamSnapshot::Close)
+  });
+
+  constructor_ = Napi::Persistent(func);
+  constructor_.SuppressDestruct();
+
+  exports.Set("VsamSnapshot", func);
+}
+
+
+Napi::Value VsamSnapshot::OpenSnapshot(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  if (info.Length() != 1 || !info[0].IsString()) {
+    Napi::Error::New(env, "Wrong arguments to openSnapshot(), must be: "\
+                          "snapshot file path").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  Napi::Object obj = constructor_.New({info[0]});
+  VsamSnapshot* p = Napi::ObjectWrap<VsamSnapshot>::Unwrap(obj);
+  if (p->base_ == NULL) {
+    Napi::Error::New(env, p->errmsg_.c_str()).ThrowAsJavaScriptException();
+    return env.Null();
+  }
+  return obj;
+}
+
+
+Napi::Value VsamSnapshot::Find(const Napi::CallbackInfo& info, bool equal) {
+  if (base_ == NULL) {
+    Napi::Error::New(env_, "Snapshot is not open.").ThrowAsJavaScriptException();
+    return env_.Null();
+  }
+  if (info.Length() < 1) {
+    Napi::Error::New(env_, "Wrong number of arguments.").ThrowAsJavaScriptException();
+    return env_.Null();
+  }
+
+  char key[header_.keylen];
+  if (!VsamFile::EncodeKey(env_, layout_[header_.key_i].type, header_.keylen, info[0], key))
+    return env_.Null();
+
+  uint64_t i = LowerBound(key);
+  if (i == header_.records ||
+      (equal && memcmp(Record(i) + header_.keyoff, key, header_.keylen)))
+    return env_.Null();
+  return VsamFile::DecodeRecord(env_, layout_, Record(i));
+}
+
+Napi::Value VsamSnapshot::FindEq(const Napi::CallbackInfo& info) {
+  return Find(info, true);
+}
+
+Napi::Value VsamSnapshot::FindGe(const Napi::CallbackInfo& info) {
+  return Find(info, false);
+}
+
+
+Napi::Value VsamSnapshot::Scan(const Napi::CallbackInfo& info) {
+  if (base_ == NULL) {
+    Napi::Error::New(env_, "Snapshot is not open.").ThrowAsJavaScriptException();
+    return env_.Null();
+  }
+  if (info.Length() < 2 || !info[1].IsFunction()) {
+    Napi::TypeError::New(env_, "Wrong arguments to scan(), must be: "\
+                               "range object or undefined, callback").ThrowAsJavaScriptException();
+    return env_.Null();
+  }
+
+  VsamFile::KeyRange range;
+  if (!VsamFile::ParseRange(env_, layout_[header_.key_i].type, header_.keylen, info[0], range))
+    return env_.Null();
+
+  // The callback may return false to stop the scan early
+  Napi::Function cb = info[1].As<Napi::Function>();
+  const unsigned keylen = header_.keylen;
+  uint64_t i = range.from_first ? 0 : LowerBound(&range.start[0]);
+  uint64_t count = 0;
+  for (; i < header_.records; ++i) {
+    const char* key = Record(i) + header_.keyoff;
+    if (range.prefixlen ? memcmp(key, &range.start[0], range.prefixlen) != 0
+                        : !range.to_last && memcmp(key, &range.end[0], keylen) > 0)
+      break;
+    Napi::HandleScope scope(env_);
+    count++;
+    Napi::Value ret = cb.Call(env_.Global(), {VsamFile::DecodeRecord(env_, layout_, Record(i))});
+    if (env_.IsExceptionPending())
+      break;
+    if (ret.IsBoolean() && !ret.As<Napi::Boolean>().Value())
+      break;
+  }
+  return Napi::Number::New(env_, count);
+}
+
+
+Napi::Value VsamSnapshot::Refresh(const Napi::CallbackInfo& info) {
+  // Switch to a snapshot rebuilt at the same path since this one was mapped.
+  // Returns whether it switched; on error the current mapping stays in use.
+  struct stat st;
+  if (stat(path_.c_str(), &st) != 0) {
+    Napi::Error::New(env_, "Failed to stat snapshot: " + std::string(strerror(errno)))
+        .ThrowAsJavaScriptException();
+    return env_.Null();
+  }
+  if (base_ != NULL && st.st_ino == ino_ && st.st_mtime == mtime_)
+    return Napi::Boolean::New(env_, false);
+
+  std::string errmsg;
+  if (!Map(errmsg)) {
+    Napi::Error::New(env_, errmsg).ThrowAsJavaScriptException();
+    return env_.Null();
+  }
+  return Napi::Boolean::New(env_, true);
+}
+
+
+void VsamSnapshot::Close(const Napi::CallbackInfo& info) {
+  if (base_ == NULL) {
+    Napi::Error::New(env_, "Snapshot is not open.").ThrowAsJavaScriptException();
+    return;
+  }
+  Unmap();
+}
@@ -0,0 +1,66 @@
+/*
+ * Licensed Materials - Property of IBM
+ * (C) Copyright IBM Corp. 2017. All Rights Reserved.
+ * US Government Users Restricted Rights - Use, duplication or disclosure restricted by GSA ADP Schedule Contract with IBM Corp.
+*/
+
+#pragma once
+#include <napi.h>
+#include <sys/types.h>
+#include "VsamFile.h"
+
+/* Read-only replica of a KSDS in a local file, served from memory.
+ *
+ * File layout (native byte order):
+ *   Header   fixed size, see below
+ *   Schema   one "name type maxLength" line per field, in record order
+ *   Data     all records, fixed length, sorted by key
+ *   Index    key of every stride'th record, for a first binary search
+ */
+class VsamSnapshot : public Napi::ObjectWrap<VsamSnapshot> {
+ public:
+  static void Init(Napi::Env env, Napi::Object exports);
+  VsamSnapshot(const Napi::CallbackInfo& info);
+  ~VsamSnapshot();
+
+  static Napi::Value OpenSnapshot(const Napi::CallbackInfo& info);
+  static bool Build(VsamFile* file, const std::string& path, std::string& errmsg);
+
+ private:
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t key_i, keyoff, keylen, reclen;
+    uint32_t stride;
+    uint64_t records;
+    uint64_t schema_off, schema_len;
+    uint64_t data_off;
+    uint64_t index_off, index_entries;
+  };
+
+  /* Entry point from Javascript */
+  Napi::Value Find(const Napi::CallbackInfo& info, bool equal);
+  Napi::Value FindEq(const Napi::CallbackInfo& info);
+  Napi::Value FindGe(const Napi::CallbackInfo& info);
+  Napi::Value Scan(const Napi::CallbackInfo& info);
+  Napi::Value Refresh(const Napi::CallbackInfo& info);
+  void Close(const Napi::CallbackInfo& info);
+
+  /* Private methods */
+  bool Map(std::string& errmsg);
+  void Unmap();
+  const char* Record(uint64_t i) const;
+  uint64_t LowerBound(const char* key) const;
+
+  /* Data */
+  static Napi::FunctionReference constructor_;
+  Napi::Env env_;
+  std::string path_;
+  std::string errmsg_;
+  char* base_;
+  size_t size_;
+  ino_t ino_;
+  time_t mtime_;
+  Header header_;
+  std::vector<VsamFile::LayoutItem> layout_;
+};
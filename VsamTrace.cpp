@@ -0,0 +1,180 @@
+/*
+ * Licensed Materials - Property of IBM
+ * (C) Copyright IBM Corp. 2017. All Rights Reserved.
+ * US Government Users Restricted Rights - Use, duplication or disclosure restricted by GSA ADP Schedule Contract with IBM Corp.
+*/
+#include "VsamTrace.h"
+#include <uv.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+static const size_t traceCapacity = 65536;  // events per thread
+
+struct VsamTrace::Event {
+  const char* name;
+  const char* op;
+  char dataset[48];
+  unsigned keylen;
+  uint64_t ts, dur;
+  int rc, fdbk;
+  bool io;
+};
+
+struct VsamTrace::Buffer {
+  std::atomic<unsigned> epoch;  // start() the events belong to
+  std::atomic<size_t> size;     // events published to stop()
+  std::atomic<size_t> dropped;  // events lost because the buffer was full
+  unsigned tid;
+  Event* events;
+  Buffer* next;
+};
+
+std::atomic<bool> VsamTrace::enabled_(false);
+std::atomic<unsigned> VsamTrace::epoch_(0);
+std::atomic<VsamTrace::Buffer*> VsamTrace::buffers_(NULL);
+std::atomic<unsigned> VsamTrace::nexttid_(1);
+std::string VsamTrace::path_;
+
+thread_local VsamTrace::Buffer* VsamTrace::local_ = NULL;
+
+
+uint64_t VsamTrace::Now() {
+  return uv_hrtime() / 1000;
+}
+
+
+VsamTrace::Buffer* VsamTrace::ThreadBuffer() {
+  // Each thread allocates its buffer once and pushes it onto the list
+  if (local_ == NULL) {
+    Buffer* b = new Buffer;
+    b->epoch.store(epoch_.load());
+    b->size.store(0);
+    b->dropped.store(0);
+    b->tid = nexttid_++;
+    b->events = new Event[traceCapacity];
+    b->next = buffers_.load();
+    while (!buffers_.compare_exchange_weak(b->next, b))
+      ;
+    local_ = b;
+  }
+  return local_;
+}
+
+
+void VsamTrace::Record(uint64_t start, const char* name, const char* op,
+                       const std::string& dataset, unsigned keylen, bool io) {
+  uint64_t end = Now();
+  int rc = 0, fdbk = 0;
+  if (io) {
+    rc = __amrc->__code.__feedback.__rc;
+    fdbk = __amrc->__code.__feedback.__fdbk;
+  }
+
+  Buffer* b = ThreadBuffer();
+  // Only the owning thread writes its buffer, so spans left from an earlier
+  // start() are discarded here rather than by start() itself
+  unsigned epoch = epoch_.load(std::memory_order_acquire);
+  if (b->epoch.load(std::memory_order_relaxed) != epoch) {
+    b->size.store(0, std::memory_order_relaxed);
+    b->dropped.store(0, std::memory_order_relaxed);
+    b->epoch.store(epoch, std::memory_order_release);
+  }
+  size_t n = b->size.load(std::memory_order_relaxed);
+  if (n >= traceCapacity) {
+    b->dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  Event& e = b->events[n];
+  e.name = name;
+  e.op = op;
+  strncpy(e.dataset, dataset.c_str(), sizeof(e.dataset) - 1);
+  e.dataset[sizeof(e.dataset) - 1] = 0;
+  e.keylen = keylen;
+  e.ts = start;
+  e.dur = end - start;
+  e.rc = rc;
+  e.fdbk = fdbk;
+  e.io = io;
+  b->size.store(n + 1, std::memory_order_release);
+}
+
+
+void VsamTrace::Init(Napi::Env env, Napi::Object exports) {
+  Napi::Object trace = Napi::Object::New(env);
+  trace.Set(Napi::String::New(env, "start"), Napi::Function::New(env, VsamTrace::Start));
+  trace.Set(Napi::String::New(env, "stop"), Napi::Function::New(env, VsamTrace::Stop));
+  exports.Set(Napi::String::New(env, "trace"), trace);
+}
+
+
+void VsamTrace::Start(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  if (info.Length() != 1 || !info[0].IsString()) {
+    Napi::Error::New(env, "Wrong arguments to trace.start(), must be: "\
+                          "output file path").ThrowAsJavaScriptException();
+    return;
+  }
+  if (enabled_.load()) {
+    Napi::Error::New(env, "Tracing is already started.").ThrowAsJavaScriptException();
+    return;
+  }
+
+  // Spans recorded before this start are left out of the next stop()
+  path_ = static_cast<std::string>(info[0].As<Napi::String>());
+  epoch_.fetch_add(1, std::memory_order_release);
+  enabled_.store(true);
+}
+
+
+Napi::Value VsamTrace::Stop(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  if (!enabled_.load()) {
+    Napi::Error::New(env, "Tracing is not started.").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+  enabled_.store(false);
+
+  FILE* out = fopen(path_.c_str(), "w");
+  if (out == NULL) {
+    Napi::Error::New(env, "Failed to create trace file: " + std::string(strerror(errno)))
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  int pid = getpid();
+  unsigned epoch = epoch_.load();
+  size_t written = 0, dropped = 0;
+  fprintf(out, "{\"traceEvents\":[");
+  for (Buffer* b = buffers_.load(); b != NULL; b = b->next) {
+    if (b->epoch.load(std::memory_order_acquire) != epoch)
+      continue;
+    size_t n = b->size.load(std::memory_order_acquire);
+    dropped += b->dropped.load();
+    for (size_t i = 0; i < n; ++i) {
+      const Event& e = b->events[i];
+      fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"vsam\",\"ph\":\"X\","
+                   "\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%u,"
+                   "\"args\":{\"dataset\":\"%s\",\"op\":\"%s\",\"keylen\":%u",
+              written ? "," : "", e.name,
+              (unsigned long long)e.ts, (unsigned long long)e.dur, pid, b->tid,
+              e.dataset, e.op, e.keylen);
+      if (e.io)
+        fprintf(out, ",\"rc\":%d,\"fdbk\":%d", e.rc, e.fdbk);
+      fprintf(out, "}}");
+      written++;
+    }
+  }
+  fprintf(out, "\n]}\n");
+  if (fclose(out) != 0) {
+    Napi::Error::New(env, "Failed to write trace file: " + std::string(strerror(errno)))
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  Napi::Object result = Napi::Object::New(env);
+  result.Set("events", Napi::Number::New(env, written));
+  result.Set("dropped", Napi::Number::New(env, dropped));
+  return result;
+}
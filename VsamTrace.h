@@ -0,0 +1,56 @@
+/*
+ * Licensed Materials - Property of IBM
+ * (C) Copyright IBM Corp. 2017. All Rights Reserved.
+ * US Government Users Restricted Rights - Use, duplication or disclosure restricted by GSA ADP Schedule Contract with IBM Corp.
+*/
+
+#pragma once
+#include <napi.h>
+#include <atomic>
+#include <string>
+
+/* Opt-in per-phase tracing of dataset operations, written out as Chrome /
+ * Perfetto trace-event JSON. Each thread appends complete spans to its own
+ * buffer without locking; stop() collects them all.
+ *
+ *   uint64_t t = VsamTrace::Begin();   // 0 while tracing is off
+ *   rc = flocate(...);
+ *   VsamTrace::End(t, "flocate", "find", path_, keylen, true);
+ */
+class VsamTrace {
+ public:
+  static void Init(Napi::Env env, Napi::Object exports);
+
+  static inline uint64_t Begin() {
+    return enabled_.load(std::memory_order_relaxed) ? Now() : 0;
+  }
+
+  // io spans also carry the __amrc feedback of the call just made
+  static inline void End(uint64_t start, const char* name, const char* op,
+                         const std::string& dataset, unsigned keylen, bool io) {
+    if (start != 0)
+      Record(start, name, op, dataset, keylen, io);
+  }
+
+ private:
+  struct Event;
+  struct Buffer;
+
+  /* Entry point from Javascript */
+  static void Start(const Napi::CallbackInfo& info);
+  static Napi::Value Stop(const Napi::CallbackInfo& info);
+
+  /* Private methods */
+  static uint64_t Now();
+  static void Record(uint64_t start, const char* name, const char* op,
+                     const std::string& dataset, unsigned keylen, bool io);
+  static Buffer* ThreadBuffer();
+
+  /* Data */
+  static std::atomic<bool> enabled_;
+  static std::atomic<unsigned> epoch_;    // bumped by each start()
+  static std::atomic<Buffer*> buffers_;
+  static std::atomic<unsigned> nexttid_;
+  static thread_local Buffer* local_;
+  static std::string path_;
+};
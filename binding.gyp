@@ -26,7 +26,7 @@
       "msvs_settings": {
         "VCCLCompilerTool": { "ExceptionHandling": 1 },
       },
-      "sources": [ "vsam.cpp", "VsamFile.cpp" ],
+      "sources": [ "vsam.cpp", "VsamFile.cpp", "VsamCursor.cpp", "VsamRegistry.cpp", "VsamIndex.cpp", "VsamSnapshot.cpp", "VsamTrace.cpp", "VsamChangeLog.cpp", "VsamKeyFilter.cpp" ],
       "defines": [ "NAPI_DISABLE_CPP_EXCEPTIONS" ],
     }
   ]
@@ -77,6 +77,36 @@ describe("Key Sequenced Dataset #2", function() {
     done();
   });
 
+  it("check existence and open the dataset asynchronously", function(done) {
+    vsam.exist(testSet, (exists) => {
+      expect(exists).to.be.true;
+      vsam.open(testSet,
+                JSON.parse(fs.readFileSync('test/test2.json')),
+                (file, err) => {
+        assert.ifError(err);
+        expect(file).to.not.be.null;
+        expect(file.close()).to.not.throw;
+        done();
+      });
+    });
+  });
+
+  it("reuse a closed handle's stream through the registry", function(done) {
+    vsam.enableRegistry(1000);
+    var file = vsam.openSync(testSet,
+                             JSON.parse(fs.readFileSync('test/test2.json')));
+    expect(file.close()).to.not.throw;
+    vsam.open(testSet,
+              JSON.parse(fs.readFileSync('test/test2.json')),
+              (file, err) => {
+      assert.ifError(err);
+      expect(file).to.not.be.null;
+      expect(file.close()).to.not.throw;
+      vsam.disableRegistry();
+      done();
+    });
+  });
+
   it("return error for opening empty dataset in read-only mode", function(done) {
     expect(() => {
       vsam.openSync(testSet,
@@ -281,6 +311,353 @@ describe("Key Sequenced Dataset #2", function() {
       });
     });
   });
+  it("interleave reads through two cursors on one handle", function(done) {
+    var file = vsam.openSync(testSet,
+                             JSON.parse(fs.readFileSync('test/test2.json')));
+    file.write({ key: "0102", name: "ANN", amount: "01" }, (err) => {
+      assert.ifError(err);
+      file.write({ key: "0304", name: "BOB", amount: "02" }, (err) => {
+        assert.ifError(err);
+        var c1 = file.cursor();
+        var c2 = file.cursor();
+        c1.read((record, err) => {
+          assert.ifError(err);
+          assert.equal(record.key, "0102", "c1 starts at the first record");
+          c2.read((record, err) => {
+            assert.ifError(err);
+            assert.equal(record.key, "0102", "c2 starts at the first record");
+            c1.read((record, err) => {
+              assert.ifError(err);
+              assert.equal(record.key, "0304", "c1 resumes after its own record");
+              c2.findge("0200", (record, err) => {
+                assert.ifError(err);
+                assert.equal(record.key, "0304", "c2 located by key");
+                c1.read((record, err) => {
+                  assert.ifError(err);
+                  assert.equal(record.key, "e5f6789afabcd0", "c1 unaffected by c2");
+                  expect(file.close()).to.not.throw;
+                  done();
+                });
+              });
+            });
+          });
+        });
+      });
+    });
+  });
+
+  it("fail delete and update past the end after another cursor ran", function(done) {
+    var file = vsam.openSync(testSet,
+                             JSON.parse(fs.readFileSync('test/test2.json')));
+    var c1 = file.cursor();
+    var c2 = file.cursor();
+    c1.findlast((record, err) => {
+      assert.ifError(err);
+      assert.equal(record.key, "e5f6789afabcd0");
+      c1.read((record, err) => {
+        assert.ifError(err);
+        expect(record).to.be.null;
+        c2.read((record, err) => {
+          assert.ifError(err);
+          c1.delete((err) => {
+            expect(err).to.match(/no current record/);
+            c1.update({ key: "e5f6789afabcd0", name: "NOBODY", amount: "00" }, (err) => {
+              expect(err).to.match(/no current record/);
+              file.find("e5f6789afabcd0", (record, err) => {
+                assert.ifError(err);
+                assert.equal(record.key, "e5f6789afabcd0", "last record was kept");
+                assert.notEqual(record.name.trim(), "NOBODY", "last record was not updated");
+                expect(file.close()).to.not.throw;
+                done();
+              });
+            });
+          });
+        });
+      });
+    });
+  });
+
+  it("apply a batch of keyed operations", function(done) {
+    var file = vsam.openSync(testSet,
+                             JSON.parse(fs.readFileSync('test/test2.json')));
+    file.apply([
+      { op: "write", record: { key: "0506", name: "CAROL", amount: "03" } },
+      { op: "update", key: "0102", record: { name: "ANNE" } },
+      { op: "upsert", record: { key: "0708", name: "DAVE", amount: "04" } },
+      { op: "delete", key: "0708" }
+    ], (results, err) => {
+      assert.ifError(err);
+      expect(results).to.deep.equal([null, null, null, null]);
+      file.find("0102", (record, err) => {
+        assert.ifError(err);
+        assert.equal(record.name, "ANNE", "name was patched");
+        assert.equal(record.amount, "01", "amount was left alone");
+        expect(file.close()).to.not.throw;
+        done();
+      });
+    });
+  });
+
+  it("undo an atomic batch that fails part way", function(done) {
+    var file = vsam.openSync(testSet,
+                             JSON.parse(fs.readFileSync('test/test2.json')));
+    file.apply([
+      { op: "update", key: "0102", record: { name: "ANNIE" } },
+      { op: "delete", key: "0506" },
+      { op: "update", key: "0909", record: { name: "NOBODY" } }
+    ], { atomic: true }, (results, err) => {
+      expect(err).to.match(/Operation 2 failed: Record not found/);
+      assert.equal(results[0], "Undone");
+      assert.equal(results[1], "Undone");
+      file.find("0102", (record, err) => {
+        assert.ifError(err);
+        assert.equal(record.name, "ANNE", "update was undone");
+        file.find("0506", (record, err) => {
+          assert.ifError(err);
+          assert.equal(record.name, "CAROL", "delete was undone");
+          expect(file.close()).to.not.throw;
+          done();
+        });
+      });
+    });
+  });
+
+  it("update, upsert and delete records by key", function(done) {
+    var file = vsam.openSync(testSet,
+                             JSON.parse(fs.readFileSync('test/test2.json')));
+    file.updateByKey("0506", { amount: "33" }, (err) => {
+      assert.ifError(err);
+      file.upsert({ key: "0a0b", name: "EVE", amount: "05" }, (err) => {
+        assert.ifError(err);
+        file.find("0506", (record, err) => {
+          assert.ifError(err);
+          assert.equal(record.name, "CAROL", "name was left alone");
+          assert.equal(record.amount, "33", "amount was patched");
+          file.deleteByKey("0a0b", (err) => {
+            assert.ifError(err);
+            file.deleteByKey("0a0b", (err) => {
+              expect(err).to.match(/Record not found/);
+              expect(file.close()).to.not.throw;
+              done();
+            });
+          });
+        });
+      });
+    });
+  });
+
+  it("aggregate over a key range", function(done) {
+    var file = vsam.openSync(testSet,
+                             JSON.parse(fs.readFileSync('test/test2.json')));
+    file.aggregate({
+      range: { start: "01", end: "06" },
+      metrics: [ "count", "min(key)", "max(name)" ]
+    }, (rows, err) => {
+      assert.ifError(err);
+      expect(rows).to.deep.equal([{ "count": 3, "min(key)": "0102", "max(name)": "CAROL" }]);
+      file.aggregate({ groupBy: "name" }, (rows, err) => {
+        assert.ifError(err);
+        expect(rows).to.have.lengthOf(4);
+        assert.equal(rows[0].name, "ANNE");
+        assert.equal(rows[0].count, 1);
+        file.aggregate({
+          range: { prefix: "09" },
+          metrics: [ "count", "max(name)" ]
+        }, (rows, err) => {
+          assert.ifError(err);
+          expect(rows).to.deep.equal([{ "count": 0, "max(name)": null }]);
+          expect(() => file.aggregate({ range: { prefix: "050" } }, () => {})).to.throw(/even|whole/);
+          expect(file.close()).to.not.throw;
+          done();
+        });
+      });
+    });
+  });
+
+  it("look up records through a unique secondary index", function(done) {
+    var file = vsam.openSync(testSet,
+                             JSON.parse(fs.readFileSync('test/test2.json')));
+    file.createIndex("name", { unique: true }, (stats, err) => {
+      assert.ifError(err);
+      assert.equal(stats.entries, 4);
+      expect(stats.bytes).to.be.above(0);
+      file.findBy("name", "BOB", (record, err) => {
+        assert.ifError(err);
+        assert.equal(record.key, "0304");
+        file.write({ key: "0c0d", name: "BOB", amount: "06" }, (err) => {
+          expect(err).to.match(/Duplicate value for unique index on name/);
+          file.updateByKey("0304", { name: "BOBBY" }, (err) => {
+            assert.ifError(err);
+            file.findBy("name", "BOB", (record, err) => {
+              expect(record).to.be.null;
+              file.findBy("name", "BOBBY", (record, err) => {
+                assert.ifError(err);
+                assert.equal(record.key, "0304");
+                expect(file.close()).to.not.throw;
+                done();
+              });
+            });
+          });
+        });
+      });
+    });
+  });
+
+  it("serve lookups from a local snapshot", function(done) {
+    var file = vsam.openSync(testSet,
+                             JSON.parse(fs.readFileSync('test/test2.json')));
+    const snapPath = `/tmp/${uid}.ksds2.snap`;
+    file.snapshot(snapPath, (err) => {
+      assert.ifError(err);
+      var snap = vsam.openSnapshot(snapPath);
+      assert.equal(snap.find("0506").name, "CAROL");
+      assert.equal(snap.findge("0400").key, "0506");
+      expect(snap.find("0400")).to.be.null;
+      var keys = [];
+      assert.equal(snap.scan({ start: "01", end: "04" }, (record) => { keys.push(record.key); }), 2);
+      expect(keys).to.deep.equal(["0102", "0304"]);
+      file.snapshot(snapPath, (err) => {
+        assert.ifError(err);
+        expect(snap.refresh()).to.be.true;
+        assert.equal(snap.find("0102").name, "ANNE");
+        expect(snap.close()).to.not.throw;
+        fs.unlinkSync(snapPath);
+        expect(file.close()).to.not.throw;
+        done();
+      });
+    });
+  });
+
+  it("delete a range of records", function(done) {
+    var file = vsam.openSync(testSet,
+                             JSON.parse(fs.readFileSync('test/test2.json')));
+    file.apply([
+      { op: "write", record: { key: "0a01", name: "TMP1", amount: "01" } },
+      { op: "write", record: { key: "0a02", name: "TMP2", amount: "02" } },
+      { op: "write", record: { key: "0a03", name: "TMP3", amount: "03" } }
+    ], (results, err) => {
+      assert.ifError(err);
+      file.deleteRange("0a00", "0aff", { dryRun: true }, (result, err) => {
+        assert.ifError(err);
+        assert.equal(result.matched, 3);
+        file.deleteRange("0a00", "0aff", { limit: 2 }, (result, err) => {
+          assert.ifError(err);
+          assert.equal(result.deleted, 2);
+          file.deleteRange("0a00", "0aff", (result, err) => {
+            assert.ifError(err);
+            assert.equal(result.deleted, 1);
+            file.keys((keys, err) => {
+              assert.ifError(err);
+              expect(keys).to.deep.equal(["0102", "0304", "0506", "e5f6789afabcd0"]);
+              expect(file.close()).to.not.throw;
+              done();
+            });
+          });
+        });
+      });
+    });
+  });
+
+  it("probe keys with and without a key filter", function(done) {
+    var file = vsam.openSync(testSet,
+                             JSON.parse(fs.readFileSync('test/test2.json')));
+    file.has("0304", (exists, err) => {
+      assert.ifError(err);
+      expect(exists).to.be.true;
+      file.hasMany(["0102", "0708", "0506"], (found, err) => {
+        assert.ifError(err);
+        expect(found).to.deep.equal([true, false, true]);
+        file.keys({ start: "01", end: "04" }, (keys, err) => {
+          assert.ifError(err);
+          expect(keys).to.deep.equal(["0102", "0304"]);
+          file.buildKeyFilter({ expectedKeys: 100 }, (stats, err) => {
+            assert.ifError(err);
+            assert.equal(stats.keys, 4);
+            file.has("0708", (exists, err) => {
+              expect(exists).to.be.false;
+              file.upsert({ key: "0708", name: "DAVE", amount: "07" }, (err) => {
+                assert.ifError(err);
+                file.has("0708", (exists, err) => {
+                  expect(exists).to.be.true;
+                  file.deleteByKey("0708", (err) => {
+                    assert.ifError(err);
+                    file.dropKeyFilter();
+                    expect(file.close()).to.not.throw;
+                    done();
+                  });
+                });
+              });
+            });
+          });
+        });
+      });
+    });
+  });
+
+  it("follow changes through the change log", function(done) {
+    var file = vsam.openSync(testSet,
+                             JSON.parse(fs.readFileSync('test/test2.json')));
+    expect(() => file.captureChanges(2 ** 40)).to.throw(/capacity must be from 1 to/);
+    file.captureChanges(2);
+    expect(() => file.captureChanges(8)).to.throw(/capacity of 2/);
+    expect(() => new vsam.VsamChangeFeed({}, 1)).to.throw(/changes\(\) on a VSAM file/);
+    var feed = file.changes();
+    var other = vsam.openSync(testSet,
+                              JSON.parse(fs.readFileSync('test/test2.json')));
+    feed.next().then((result) => {
+      assert.equal(result.value.op, "write");
+      assert.equal(result.value.key, "0a0b");
+      expect(result.value.before).to.be.null;
+      assert.equal(result.value.after.name, "EVE");
+      return feed.next();
+    }).then((result) => {
+      assert.equal(result.value.op, "delete");
+      assert.equal(result.value.before.name, "EVE");
+      var seq = result.value.seq;
+      expect(other.close()).to.not.throw;
+      return feed.return().then(() => {
+        var tail = file.changes({ fromSeq: seq - 1 });
+        return tail.next().then((result) => {
+          assert.equal(result.value.seq, seq - 1);
+          file.stopCapture();
+          return tail.next();
+        }).then((result) => {
+          assert.equal(result.value.seq, seq);
+          return tail.next();
+        }).then((result) => {
+          assert.isTrue(result.done);
+          expect(() => file.changes()).to.throw(/not enabled/);
+          expect(file.close()).to.not.throw;
+          done();
+        });
+      });
+    }).catch(done);
+    other.upsert({ key: "0a0b", name: "EVE", amount: "05" }, (err) => {
+      assert.ifError(err);
+      other.deleteByKey("0a0b", (err) => {
+        assert.ifError(err);
+      });
+    });
+  });
+
+  it("trace the phases of a find", function(done) {
+    var file = vsam.openSync(testSet,
+                             JSON.parse(fs.readFileSync('test/test2.json')));
+    const tracePath = `/tmp/${uid}.ksds2.trace.json`;
+    vsam.trace.start(tracePath);
+    file.find("0506", (record, err) => {
+      assert.ifError(err);
+      var stats = vsam.trace.stop();
+      assert.equal(stats.dropped, 0);
+      var names = JSON.parse(fs.readFileSync(tracePath)).traceEvents.map((e) => e.name);
+      assert.equal(names.length, stats.events);
+      expect(names).to.include.members(["queue", "flocate", "fread", "decode"]);
+      fs.unlinkSync(tracePath);
+      expect(file.close()).to.not.throw;
+      done();
+    });
+  });
+
   it("deallocate a dataset", function(done) {
     var file = vsam.openSync(testSet,
                              JSON.parse(fs.readFileSync('test/test2.json')));
@@ -6,14 +6,32 @@
 
 #include <napi.h>
 #include "VsamFile.h"
+#include "VsamCursor.h"
+#include "VsamRegistry.h"
+#include "VsamSnapshot.h"
+#include "VsamTrace.h"
+#include "VsamChangeLog.h"
+#include "VsamKeyFilter.h"
 
 Napi::Object InitAll(Napi::Env env, Napi::Object exports) {
   VsamFile::Init(env,exports);
+  VsamCursor::Init(env,exports);
+  VsamRegistry::Init(env,exports);
+  VsamSnapshot::Init(env,exports);
+  VsamTrace::Init(env,exports);
+  VsamChangeLog::Init(env,exports);
+  VsamKeyFilter::Init(env,exports);
 
   exports.Set(Napi::String::New(env, "openSync"),
               Napi::Function::New(env, VsamFile::OpenSync));
   exports.Set(Napi::String::New(env, "allocSync"),
               Napi::Function::New(env, VsamFile::AllocSync));
+  exports.Set(Napi::String::New(env, "open"),
+              Napi::Function::New(env, VsamFile::OpenAsync));
+  exports.Set(Napi::String::New(env, "alloc"),
+              Napi::Function::New(env, VsamFile::AllocAsync));
+  exports.Set(Napi::String::New(env, "openSnapshot"),
+              Napi::Function::New(env, VsamSnapshot::OpenSnapshot));
   exports.Set(Napi::String::New(env, "exist"),
               Napi::Function::New(env, VsamFile::Exist));
   return exports;